@@ -24,244 +24,1940 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
 #include <stm32f10x_tim.h>
+#include <stm32f10x_dma.h>
+#include <stm32f10x_crc.h>
 #include "audio.h"
 #include "winbond25q64.h"
 #include "main.h"
 #include "crc32.h"
 #include "time.h"
+#include "stats.h"
+#include "audio_filter.h"
 
-#define AUDIO_BUFFER_SIZE 		256
+/* Audio data is streamed from the SPI flash into one ring of blocks per
+ * voice. Refills are chained from the DMA completion interrupt, so the sample
+ * path only ever touches the ring when it has consumed a whole block. All
+ * voices share the SPI bus; the emptiest ring is refilled first. */
+#define AUDIO_VOICE_COUNT		3
+#define AUDIO_BLOCK_SIZE		512
+#define AUDIO_BLOCK_COUNT		3
 #define MAX_FILE_COUNT			8
 
+/* IMA-ADPCM files consist of self-contained 256 byte blocks, each with a 4
+ * byte header (initial predictor, step index, flags) followed by 504 nibbles.
+ * Stream blocks must therefore always start on an ADPCM block boundary. The
+ * last block of a file is truncated; if it holds an odd number of samples,
+ * the padding flag marks the final high nibble as unused. */
+#define IMA_ADPCM_BLOCK_SIZE	256
+#define IMA_ADPCM_HEADER_SIZE	4
+#define IMA_ADPCM_FLAG_PADDING_NIBBLE	(1 << 0)
+
+#if (AUDIO_BLOCK_SIZE % IMA_ADPCM_BLOCK_SIZE) != 0
+#error "AUDIO_BLOCK_SIZE must be a multiple of IMA_ADPCM_BLOCK_SIZE"
+#endif
+
+/* Voice gains are Q8, i.e., 256 is unity gain */
+#define AUDIO_GAIN_UNITY		256
+
+/* The mix is 16 bit, TIM1 PWM has 10 bits (period 1023 at 72 MHz, 70.3 kHz;
+ * see init_pwm()). The volume is a Q15 master gain which ramps towards its
+ * target by a fixed step per sample, so volume changes do not click. The 6
+ * bits lost in quantization are fed back into the next sample (first order
+ * noise shaping, pushing the error towards the carrier where the RC filter
+ * removes it) together with one LSB of triangular dither. Gain, dither and
+ * shaping cost about 20 cycles per sample; the total render cost per sample
+ * is measured with SysTick and shown by the 'stats' command. */
+#define AUDIO_PWM_BITS				10
+
+/* The mix runs through a cascade of biquad sections which compensates the
+ * speaker and RC filter (see audio_filter.json). Coefficients are generated at
+ * build time for a set of sample rates, the set closest to the output rate is
+ * used. Each section is Direct Form I with a 64 bit accumulator (SMLAL) and
+ * feeds the truncated fraction into its next sample. A section costs about 40
+ * cycles; the 'filterbench' command measures it against the sample period. */
+#define AUDIO_FILTER_BENCHMARK_SAMPLES	256
+#define AUDIO_MASTER_GAIN_UNITY		32768
+#define AUDIO_MASTER_GAIN_RAMP_STEP	16
+
+/* Each file carries its own sample rate. The output runs at the highest rate
+ * of all active voices, slower voices are stepped through with a Q16 phase
+ * accumulator. TIM2 is clocked at 72 MHz / 5 (see init_pwm_update_timer()). */
+#define AUDIO_DEFAULT_SAMPLE_RATE	11025
+#define AUDIO_MIN_SAMPLE_RATE		4000
+#define AUDIO_MAX_SAMPLE_RATE		44100
+#define AUDIO_TIMER_CLOCK			(72000000 / 5)
+#define AUDIO_PHASE_ONE				(1 << 16)
+#define AUDIO_PITCH_UNITY			256
+#define AUDIO_PITCH_MIN				(AUDIO_PITCH_UNITY / 2)
+#define AUDIO_PITCH_MAX				(AUDIO_PITCH_UNITY * 2)
+
+/* Every file loops: once the end of the stored data is reached, playback
+ * continues at the loop start (offset 0 unless the file has an intro). Since
+ * the ring is filled ahead, the loop start blocks are already prefetched when
+ * the last sample of the loop body plays. */
+
+/* The flash may hold several sound banks (themes), each a complete image as
+ * produced by 'audiotool compile' at its own offset; all offsets in a TOC are
+ * relative to the image. The banks are listed in a directory in the last
+ * sector of the flash, without a valid directory there is a single bank at
+ * offset 0. All TOCs are read at boot and share the silence run and cue pools,
+ * so switching banks does not read the flash: playing voices are restarted
+ * from the new bank, which costs at most the block in flight and one block
+ * fetch. */
+#define AUDIO_BANK_DIRECTORY_OFFSET	(SPIFLASH_SIZE - SPIFLASH_SECTOR_SIZE)
+#define AUDIO_MAX_BANK_COUNT		4
+
+/* A v2 TOC starts with a header holding the entry count and a CRC over all
+ * entries and the index behind them (computed like the CRC unit does, which
+ * checks it here). The index lists the name hashes (CRC-32 of the name) in
+ * ascending order, so files are found by name with a binary search in flash.
+ * Only the first MAX_FILE_COUNT entries are loaded, in a single DMA burst.
+ * Images without the magic are refused; they have to be recompiled. */
+#define AUDIO_TOC_MAGIC				0x434f5444		/* "DTOC" */
+#define AUDIO_TOC_VERSION			2
+#define AUDIO_TOC_MAX_TRIES			10
+
+/* Blocks which are read over and over again, i.e., all of a short clip like
+ * the turn signal click and the first block of every file and of every loop
+ * body, are kept in a small LRU cache in SRAM. Refilling a ring from it is a
+ * memcpy instead of a DMA transfer, which leaves the SPI bus free and starts a
+ * clip without waiting for the flash. The size is fixed at compile time. */
+#define AUDIO_CACHE_BLOCK_COUNT		6
+#define AUDIO_CACHE_MAX_FILE_LENGTH	(2 * AUDIO_BLOCK_SIZE)
+
+/* Stretches of near-silence are not stored in the image. Instead, every file
+ * may come with a table of silence runs which are inserted at given positions
+ * of the stored data; the voice outputs 0 for them without touching the SPI
+ * flash. The tables are loaded at boot. */
+#define AUDIO_MAX_SILENCE_RUNS		8
+#define AUDIO_SILENCE_POOL_SIZE		32
+
+/* Cue points are sample positions at which audio_trigger_cue_point() is
+ * called, e.g., to sync the turn signal lights to its clicks. They follow the
+ * silence runs in the file's metadata and are loaded at boot into a pool
+ * shared by all files. Each voice keeps the position of its next cue, so the
+ * sample path only does a single compare. */
+#define AUDIO_CUE_POOL_SIZE			64
+#define AUDIO_NO_CUE				0xffffffff
+
+/* Files may carry a light track: their stored data is then split into 256
+ * byte units, each beginning with one byte of light state (IMA-ADPCM blocks
+ * shrink to 255 bytes accordingly). The light bytes thus arrive with the
+ * audio data in the same DMA reads. When decoded, they are queued with the
+ * output sample clock at which they are rendered and handed to the main loop
+ * once that sample actually plays. */
+#define AUDIO_LIGHT_UNIT_SIZE		256
+#define AUDIO_LIGHT_QUEUE_SIZE		8
+#define AUDIO_FILE_FLAG_LIGHT_TRACK	(1 << 0)
+
+#if AUDIO_LIGHT_UNIT_SIZE != IMA_ADPCM_BLOCK_SIZE
+#error "Light units must coincide with IMA-ADPCM blocks"
+#endif
+
+/* Files may carry a CRC over their payload, computed the way the STM32 CRC
+ * unit does it (see audiotool). While a voice streams a file from its head,
+ * every block entering the ring is moved into the CRC unit by a memory to
+ * memory DMA and the sum is compared when the last block has arrived. The
+ * unit cannot be preloaded with an intermediate value, so only one file is
+ * verified at a time and the check is given up when that voice jumps. */
+#define AUDIO_FILE_FLAG_PAYLOAD_CRC	(1 << 1)
+
+/* The sequencer starts one-shot clips on a voice at given values of the
+ * output sample clock, optionally repeating at a fixed interval. A one-shot
+ * voice stops fetching at the end of its file and falls silent, so e.g. a
+ * short click retriggered every 4079 samples replaces a long pre-rendered
+ * loop. Only the earliest pending event is compared per sample. */
+
+/* In live mode, the host streams PCM or IMA-ADPCM data over the USART (binary
+ * protocol) straight into the ring of the engine voice, which serves as the
+ * jitter buffer; there is no flash access. Data is appended to the block
+ * behind the last filled one, which is handed to playback once full. The host
+ * may only send as many bytes as there are credits, i.e., free bytes in the
+ * ring; every data frame is answered with the current credits. */
+#define AUDIO_LIVE_VOICE			VOICE_ENGINE
+#define AUDIO_LIVE_FILENO			MAX_FILE_COUNT
+
+/* A voice can alternatively run a direct digital synthesis oscillator which
+ * plays a sequence of tones from a wavetable, without any SPI flash access.
+ * The phase accumulator is 32 bit; its top 8 bits index the table and the
+ * next 8 bits interpolate linearly. Tone frequencies are Q4 Hz, runtime pitch
+ * and tempo factors are Q8. */
+#define AUDIO_SYNTH_TABLE_BITS		8
+#define AUDIO_SYNTH_FACTOR_UNITY	256
+
+/* With AUDIO_OUTPUT_DMA, the TIM2 CC1 event triggers DMA1 channel 5 which
+ * copies the next duty cycle from a circular buffer into TIM1->CCR1.
+ * Software only renders one half of the buffer on each half/full transfer
+ * interrupt (43 interrupts per second at 11025 Hz). Without it, every sample
+ * is written from the TIM2 CC1 interrupt. */
+#define AUDIO_OUTPUT_DMA
+#define AUDIO_OUTPUT_BUFFER_SIZE	512
+
+enum audio_codec_t {
+	CODEC_PCM_U8 = 0,
+	CODEC_IMA_ADPCM = 1,
+};
+
 struct audio_toc_entry_t {
 	uint32_t begin_disk_offset;
 	uint32_t file_length;
-	uint8_t filename[52];
+	uint8_t codec;
+	uint8_t flags;
+	uint16_t sample_rate;
+	uint8_t filename[32];
+	uint32_t loop_start_offset;
+	uint32_t loop_start_position;
+	uint32_t metadata_offset;			/* Silence runs, then cue positions */
+	uint16_t silence_run_count;
+	uint16_t cue_count;
+	uint32_t crc32;
+} __attribute__ ((packed));
+
+struct audio_toc_header_t {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_count;
+	uint32_t toc_crc32;
+	uint32_t crc32;
+} __attribute__ ((packed));
+
+struct audio_toc_index_entry_t {
+	uint32_t name_hash;
+	uint16_t entry_no;
+	uint16_t reserved;
+} __attribute__ ((packed));
+
+struct audio_silence_run_t {
+	uint32_t data_offset;		/* Offset into the stored data at which the run is inserted */
+	uint32_t sample_count;
+} __attribute__ ((packed));
+
+struct audio_bank_entry_t {
+	uint32_t image_offset;
+	uint8_t name[24];
 	uint32_t crc32;
 } __attribute__ ((packed));
 
+struct audio_file_info_t {
+	unsigned int begin_disk_offset;
+	unsigned int file_length;
+	enum audio_codec_t codec;
+	bool light_track;
+	unsigned int sample_rate;
+	unsigned int loop_start_offset;
+	unsigned int loop_start_position;
+	const struct audio_silence_run_t *silence_runs;
+	unsigned int silence_run_count;
+	const uint32_t *cues;
+	unsigned int cue_count;
+	bool payload_crc_present;
+	bool payload_crc_verified;
+	uint32_t payload_crc;
+};
+
 struct active_audio_file_t {
 	int fileno;
+	enum audio_codec_t codec;
+	bool light_track;
+	unsigned int sample_rate;
 	unsigned int playback_offset;
 	unsigned int begin_disk_offset;
 	unsigned int file_length;
+	unsigned int loop_start_offset;
+	unsigned int loop_start_position;
+	const struct audio_silence_run_t *silence_runs;
+	unsigned int silence_run_count;
+	const uint32_t *cues;
+	unsigned int cue_count;
+};
+
+struct ima_adpcm_state_t {
+	int32_t predictor;
+	unsigned int step_index;
+	bool high_nibble;
+	bool padding_nibble;
+};
+
+struct audio_block_t {
+	int fileno;
+	unsigned int file_offset;
+	unsigned int length;
+	bool end_of_file;
+	uint8_t data[AUDIO_BLOCK_SIZE] __attribute__ ((aligned (4)));		/* Word DMA into the CRC unit */
+};
+
+struct audio_stream_t {
+	struct audio_block_t blocks[AUDIO_BLOCK_COUNT];
+	unsigned int read_index;
+	unsigned int read_offset;
+	unsigned int fill;
+	bool discard_dma;
+};
+
+struct audio_silence_state_t {
+	unsigned int next_run;
+	unsigned int remaining;
+	bool end_of_file;
 };
 
-struct audio_buffer_t {
+struct audio_synth_t {
+	const struct audio_synth_tone_t *tones;		/* NULL unless the voice synthesizes */
+	unsigned int tone_count;
+	unsigned int tone_index;
+	unsigned int remaining;			/* Output samples left of the current tone */
+	uint32_t phase;
+	uint32_t step;
+};
+
+struct audio_sequence_t {
+	int fileno;					/* -1 if the voice is not sequenced */
+	uint32_t next_clock;
+	unsigned int interval;		/* 0 for a single shot */
+};
+
+struct audio_voice_t {
+	struct active_audio_file_t file;
+	struct audio_synth_t synth;
+	struct audio_sequence_t sequence;
+	bool one_shot;
+	struct audio_stream_t stream;
+	struct ima_adpcm_state_t adpcm;
+	struct audio_silence_state_t silence;
+	unsigned int position;
+	uint32_t phase;
+	uint32_t step;
+	int16_t previous_sample;
+	int16_t current_sample;
+	unsigned int pitch;
+	unsigned int gain;
+	unsigned int next_cue;
+	uint32_t next_cue_position;
+};
+
+static struct audio_voice_t voices[AUDIO_VOICE_COUNT];
+static uint32_t sequencer_next_clock;
+static struct {
+	bool active;
+	unsigned int partial;			/* Bytes in the block which is being filled */
+} live;
+
+/* Voice whose block is currently being fetched; NULL when no audio read is queued */
+static struct audio_voice_t *dma_voice;
+static struct spiflash_transaction_t flash_read;
+
+/* For the health statistics: SysTick value when the DMA in flight was
+ * requested (latencies above the 10ms SysTick period would wrap, a block
+ * takes well below 1ms) and failed attempts of the current block */
+static struct {
+	uint32_t request_systick;
+	unsigned int retries;
+} dma_health;
+
+/* File whose payload CRC is being computed from the blocks of one voice */
+static struct {
+	const struct audio_voice_t *voice;		/* NULL if the CRC unit is idle */
+	struct audio_file_info_t *file;
+	unsigned int next_offset;
+} payload_check;
+
+/* Head of the clip which is likely to be played next. It is fetched whenever
+ * no voice needs a refill, and a switch to that clip starts with this block
+ * instead of waiting for a SPI round trip. */
+static struct {
+	int fileno;				/* -1 if nothing requested */
 	bool valid;
-	unsigned int samples_total;
-	unsigned int offset;
-	unsigned int absolute_offset;
-	uint8_t data[4 + AUDIO_BUFFER_SIZE];
+	bool dma_active;
+	bool discard_dma;
+	struct audio_block_t block;
+} standby;
+
+static struct {
+	struct {
+		unsigned int disk_offset;
+		unsigned int last_used;
+		unsigned int length;		/* 0 if the slot is empty */
+		uint8_t data[AUDIO_BLOCK_SIZE];
+	} slots[AUDIO_CACHE_BLOCK_COUNT];
+	unsigned int clock;
+} cache;
+
+static struct {
+	struct {
+		char name[24];
+		unsigned int image_offset;
+		unsigned int toc_entry_count;		/* 0 if no valid TOC was found */
+		struct audio_file_info_t files[MAX_FILE_COUNT];
+	} banks[AUDIO_MAX_BANK_COUNT];
+	unsigned int count;
+	unsigned int active;
+} bank_directory;
+
+/* Files of the active bank */
+static struct audio_file_info_t *present_files = bank_directory.banks[0].files;
+
+static struct audio_silence_run_t silence_run_pool[AUDIO_SILENCE_POOL_SIZE];
+static unsigned int silence_run_pool_used;
+static uint32_t cue_pool[AUDIO_CUE_POOL_SIZE];
+static unsigned int cue_pool_used;
+
+static const int8_t ima_adpcm_index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8,
 };
 
-static struct active_audio_file_t audio_file = {
-	.fileno = 0,
-	.playback_offset = 0,
-	.begin_disk_offset = 0,
-	.file_length = 	0,
+static const uint16_t ima_adpcm_step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+	11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+	32767,
+};
+/* Odd harmonics 1, 3, 5 and 7 for a horn-like timbre; still free of aliasing
+ * at 11025 Hz up to roughly 700 Hz fundamental */
+static const int16_t synth_wavetable[1 << AUDIO_SYNTH_TABLE_BITS] = {
+	0, 2528, 5024, 7457, 9797, 12017, 14091, 15998, 17719, 19240, 20552, 21647, 22526, 23192, 23651, 23916,
+	24000, 23922, 23702, 23363, 22928, 22421, 21867, 21291, 20714, 20158, 19641, 19180, 18789, 18477, 18252, 18117,
+	18072, 18116, 18241, 18439, 18702, 19014, 19365, 19738, 20120, 20495, 20850, 21173, 21452, 21678, 21844, 21945,
+	21979, 21946, 21848, 21690, 21480, 21225, 20937, 20626, 20304, 19984, 19678, 19397, 19151, 18949, 18800, 18708,
+	18677, 18708, 18800, 18949, 19151, 19397, 19678, 19984, 20304, 20626, 20937, 21225, 21480, 21690, 21848, 21946,
+	21979, 21945, 21844, 21678, 21452, 21173, 20850, 20495, 20120, 19738, 19365, 19014, 18702, 18439, 18241, 18116,
+	18072, 18117, 18252, 18477, 18789, 19180, 19641, 20158, 20714, 21291, 21867, 22421, 22928, 23363, 23702, 23922,
+	24000, 23916, 23651, 23192, 22526, 21647, 20552, 19240, 17719, 15998, 14091, 12017, 9797, 7457, 5024, 2528,
+	0, -2528, -5024, -7457, -9797, -12017, -14091, -15998, -17719, -19240, -20552, -21647, -22526, -23192, -23651, -23916,
+	-24000, -23922, -23702, -23363, -22928, -22421, -21867, -21291, -20714, -20158, -19641, -19180, -18789, -18477, -18252, -18117,
+	-18072, -18116, -18241, -18439, -18702, -19014, -19365, -19738, -20120, -20495, -20850, -21173, -21452, -21678, -21844, -21945,
+	-21979, -21946, -21848, -21690, -21480, -21225, -20937, -20626, -20304, -19984, -19678, -19397, -19151, -18949, -18800, -18708,
+	-18677, -18708, -18800, -18949, -19151, -19397, -19678, -19984, -20304, -20626, -20937, -21225, -21480, -21690, -21848, -21946,
+	-21979, -21945, -21844, -21678, -21452, -21173, -20850, -20495, -20120, -19738, -19365, -19014, -18702, -18439, -18241, -18116,
+	-18072, -18117, -18252, -18477, -18789, -19180, -19641, -20158, -20714, -21291, -21867, -22421, -22928, -23363, -23702, -23922,
+	-24000, -23916, -23651, -23192, -22526, -21647, -20552, -19240, -17719, -15998, -14091, -12017, -9797, -7457, -5024, -2528,
+};
+static unsigned int synth_pitch = AUDIO_SYNTH_FACTOR_UNITY;
+static unsigned int synth_tempo = AUDIO_SYNTH_FACTOR_UNITY;
+struct audio_filter_section_t {
+	int32_t b0, b1, b2, a1, a2;		/* a1 and a2 negated */
+};
+
+struct audio_filter_coefficients_t {
+	unsigned int sample_rate;
+	struct audio_filter_section_t sections[AUDIO_FILTER_SECTION_COUNT];
 };
 
-enum filling_action_t {
-	IDLE,
-	FILLING,
+struct audio_filter_state_t {
+	int32_t x1, x2;
+	int32_t y1, y2;
+	int32_t error;
 };
 
-static struct audio_buffer_t audio_buffers[2];
-static unsigned int buffer_index = 0;
-static enum filling_action_t filling_action = IDLE;
+static const struct audio_filter_coefficients_t filter_coefficients[AUDIO_FILTER_RATE_COUNT] = AUDIO_FILTER_COEFFICIENTS;
 static struct {
-	unsigned int begin_disk_offset;
-	unsigned int file_length;
-} present_files[MAX_FILE_COUNT];
-static int trigger_point = -1;
-static unsigned int trigger_point_index = 0;
-static uint8_t shift_value = 3;
+	const struct audio_filter_coefficients_t *coefficients;
+	struct audio_filter_state_t state[AUDIO_FILTER_SECTION_COUNT];
+} filter = {
+	.coefficients = &filter_coefficients[0],
+};
+static const uint16_t volume_gains[] = {
+	0, AUDIO_MASTER_GAIN_UNITY / 8, AUDIO_MASTER_GAIN_UNITY / 4, AUDIO_MASTER_GAIN_UNITY / 2, AUDIO_MASTER_GAIN_UNITY,
+};
+static struct {
+	unsigned int gain;				/* Q15 */
+	unsigned int target_gain;
+	int32_t error;					/* Quantization error of the last sample */
+	uint32_t dither_seed;
+} output_stage = {
+	.gain = AUDIO_MASTER_GAIN_UNITY / 8,
+	.target_gain = AUDIO_MASTER_GAIN_UNITY / 8,
+	.dither_seed = 1,
+};
+#ifdef AUDIO_OUTPUT_DMA
+static uint16_t output_buffer[AUDIO_OUTPUT_BUFFER_SIZE];
+#endif
+static struct {
+	bool active;
+	uint32_t render_clock;			/* Number of samples rendered so far */
+	unsigned int sample_rate;		/* Rate the mixer currently renders at */
+	unsigned int requested_rate;
+	uint16_t pending_reload;		/* TIM2 ARR for when the DMA reaches the first sample rendered at sample_rate */
+} output = {
+	.sample_rate = AUDIO_DEFAULT_SAMPLE_RATE,
+	.requested_rate = AUDIO_DEFAULT_SAMPLE_RATE,
+};
+
+static struct {
+	struct {
+		uint32_t timestamp;
+		uint8_t state;
+	} events[AUDIO_LIGHT_QUEUE_SIZE];
+	unsigned int read_index;
+	unsigned int fill;
+} light_queue;
+
+static inline int32_t ssat16(int32_t value) {
+	__asm__ ("ssat %0, #16, %1" : "=r" (value) : "r" (value));
+	return value;
+}
+
+static inline int32_t usat_pwm(int32_t value) {
+	__asm__ ("usat %0, %1, %2" : "=r" (value) : "I" (AUDIO_PWM_BITS), "r" (value));
+	return value;
+}
+
+static uint16_t audio_next_output_value(void) {
+	if (output_stage.gain < output_stage.target_gain) {
+		output_stage.gain += AUDIO_MASTER_GAIN_RAMP_STEP;
+	} else if (output_stage.gain > output_stage.target_gain) {
+		output_stage.gain -= AUDIO_MASTER_GAIN_RAMP_STEP;
+	}
+
+	/* Like the former right shift, the gain scales the DC offset along with
+	 * the signal; at volume 0 the output rests at 0. */
+	const uint32_t value = ((uint32_t)(audio_next_sample() + 32768) * output_stage.gain) >> 15;
+
+	/* Triangular dither from two 6 bit fields of an LCG, +-1 LSB */
+	output_stage.dither_seed = (output_stage.dither_seed * 1664525) + 1013904223;
+	const int32_t dither = (int32_t)(output_stage.dither_seed >> 26) - (int32_t)((output_stage.dither_seed >> 20) & 0x3f);
 
-static struct audio_buffer_t* get_current_audio_buffer(void) {
-	return &audio_buffers[buffer_index];
+	/* Only the quantization error is fed back, not what saturation cuts off */
+	const int32_t shaped = (int32_t)value - output_stage.error;
+	const int32_t quantized = (shaped + dither + (1 << (15 - AUDIO_PWM_BITS))) >> (16 - AUDIO_PWM_BITS);
+	output_stage.error = (quantized << (16 - AUDIO_PWM_BITS)) - shaped;
+	return usat_pwm(quantized);
 }
 
-static struct audio_buffer_t* get_next_audio_buffer(void) {
-	return &audio_buffers[1 - buffer_index];
+static uint16_t audio_rate_to_reload(unsigned int sample_rate) {
+	return ((AUDIO_TIMER_CLOCK + (sample_rate / 2)) / sample_rate) - 1;
 }
 
+static void audio_voice_update_step(struct audio_voice_t *voice) {
+	/* The pitch is Q8 so the Q16 step is shifted by only 8 */
+	voice->step = (((uint64_t)voice->file.sample_rate * voice->pitch) << 8) / output.sample_rate;
+}
+
+static void audio_synth_update_step(struct audio_voice_t *voice) {
+	if (voice->synth.tones) {
+		const uint32_t frequency = voice->synth.tones[voice->synth.tone_index].frequency;
+		voice->synth.step = (((uint64_t)frequency * synth_pitch) << (32 - 4 - 8)) / output.sample_rate;
+	}
+}
+
+static void audio_filter_select(unsigned int sample_rate) {
+	unsigned int best_distance = ~0u;
+	for (unsigned int i = 0; i < AUDIO_FILTER_RATE_COUNT; i++) {
+		const unsigned int distance = (filter_coefficients[i].sample_rate > sample_rate) ? (filter_coefficients[i].sample_rate - sample_rate) : (sample_rate - filter_coefficients[i].sample_rate);
+		if (distance < best_distance) {
+			best_distance = distance;
+			filter.coefficients = &filter_coefficients[i];
+		}
+	}
+}
+
+static int32_t audio_filter_sample(int32_t sample) {
+	for (unsigned int i = 0; i < AUDIO_FILTER_SECTION_COUNT; i++) {
+		const struct audio_filter_section_t *coefficients = &filter.coefficients->sections[i];
+		struct audio_filter_state_t *state = &filter.state[i];
+		int64_t accu = state->error;
+		accu += (int64_t)coefficients->b0 * sample;
+		accu += (int64_t)coefficients->b1 * state->x1;
+		accu += (int64_t)coefficients->b2 * state->x2;
+		accu += (int64_t)coefficients->a1 * state->y1;
+		accu += (int64_t)coefficients->a2 * state->y2;
+		const int32_t output_sample = accu >> AUDIO_FILTER_COEFFICIENT_BITS;
+		state->error = accu & ((1 << AUDIO_FILTER_COEFFICIENT_BITS) - 1);
+		state->x2 = state->x1;
+		state->x1 = sample;
+		state->y2 = state->y1;
+		state->y1 = output_sample;
+		sample = output_sample;
+	}
+	return sample;
+}
+
+static void audio_apply_output_rate(void) {
+	output.sample_rate = output.requested_rate;
+	audio_filter_select(output.sample_rate);
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		audio_voice_update_step(&voices[i]);
+		audio_synth_update_step(&voices[i]);
+	}
+}
+
+#ifdef AUDIO_OUTPUT_DMA
+static void audio_render_output(uint16_t *buffer, unsigned int count) {
+	/* The DMA has just started playing the half which was rendered last. If
+	 * that was the first one at a new rate, switch TIM2 over now; ARR is
+	 * preloaded so the change takes effect on the next update event. */
+	if (output.pending_reload) {
+		TIM2->ARR = output.pending_reload;
+		output.pending_reload = 0;
+	}
+	if (output.requested_rate != output.sample_rate) {
+		audio_apply_output_rate();
+		output.pending_reload = audio_rate_to_reload(output.sample_rate);
+	}
+
+	const uint32_t start = SysTick->VAL;
+	for (unsigned int i = 0; i < count; i++) {
+		buffer[i] = audio_next_output_value();
+	}
+
+	stats_render_cycles(systick_cycles_since(start) / count);
+}
+
+void DMA1_Channel5_Handler(void) {
+	if (DMA_GetITStatus(DMA1_IT_HT5)) {
+		/* DMA now plays the second half, render the first one */
+		DMA_ClearITPendingBit(DMA1_IT_HT5);
+		audio_render_output(output_buffer, AUDIO_OUTPUT_BUFFER_SIZE / 2);
+	}
+	if (DMA_GetITStatus(DMA1_IT_TC5)) {
+		DMA_ClearITPendingBit(DMA1_IT_TC5);
+		audio_render_output(output_buffer + (AUDIO_OUTPUT_BUFFER_SIZE / 2), AUDIO_OUTPUT_BUFFER_SIZE / 2);
+	}
+}
+
+static void audio_output_start(void) {
+	if (output.active) {
+		return;
+	}
+	output.active = true;
+
+	/* Start with silence, actual samples are rendered on the first half
+	 * transfer interrupt */
+	memset(output_buffer, 0, sizeof(output_buffer));
+	DMA_Channel_TypeDef *dma_channel = DMA1_Channel5;
+	DMA_ClearFlag(DMA1_FLAG_GL5 | DMA1_FLAG_TC5 | DMA1_FLAG_HT5 | DMA1_FLAG_TE5);
+	dma_channel->CMAR = (uint32_t)output_buffer;
+	dma_channel->CNDTR = AUDIO_OUTPUT_BUFFER_SIZE;
+	DMA_Cmd(dma_channel, ENABLE);
+	TIM_DMACmd(TIM2, TIM_DMA_CC1, ENABLE);
+}
+
+static void audio_output_stop(void) {
+	TIM_DMACmd(TIM2, TIM_DMA_CC1, DISABLE);
+	DMA_Cmd(DMA1_Channel5, DISABLE);
+	output.active = false;
+}
+#else
 void TIM2_Handler(void) {
 	if (TIM_GetITStatus(TIM2, TIM_IT_CC1) != RESET)   {
-		TIM1->CCR1 = audio_next_sample() >> shift_value;
+		TIM1->CCR1 = audio_next_output_value();
 		TIM_ClearITPendingBit(TIM2, TIM_IT_CC1);
 	}
 }
 
+static void audio_output_start(void) {
+	output.active = true;
+	TIM_ITConfig(TIM2, TIM_IT_CC1, ENABLE);
+}
+
+static void audio_output_stop(void) {
+	TIM_ITConfig(TIM2, TIM_IT_CC1, DISABLE);
+	output.active = false;
+}
+#endif
+
 void audio_set_volume(unsigned int volume) {
 	if (volume > 4) {
 		volume = 4;
 	}
-	if (volume == 0) {
-		shift_value = 8;
-	} else if (volume == 1) {
-		shift_value = 3;
-	} else if (volume == 2) {
-		shift_value = 2;
-	} else if (volume == 3) {
-		shift_value = 1;
-	} else if (volume == 4) {
-		shift_value = 0;
+	/* The output stage ramps there sample by sample */
+	output_stage.target_gain = volume_gains[volume];
+}
+
+static void audio_stream_dma_finished(struct spiflash_transaction_t *transaction);
+static void audio_standby_dma_finished(struct spiflash_transaction_t *transaction);
+
+/* Audio has at most one read queued, ahead of all other flash traffic */
+static void audio_flash_read(unsigned int disk_offset, void *data, unsigned int length, spiflash_callback_t callback) {
+	dma_health.request_systick = SysTick->VAL;
+	flash_read = (struct spiflash_transaction_t){
+		.type = SPIFLASH_TRANSACTION_READ,
+		.address = disk_offset,
+		.data = data,
+		.length = length,
+		.callback = callback,
+	};
+	spiflash_submit(&flash_read, SPIFLASH_PRIORITY_AUDIO);
+}
+
+static void audio_dma_completed(enum dma_state_t dma_state) {
+	stats_audio_dma_latency(systick_cycles_since(dma_health.request_systick) / 72);
+	if (dma_state == DMA_SUCCESS) {
+		stats_audio_block_retries(dma_health.retries);
+		dma_health.retries = 0;
+	} else {
+		dma_health.retries++;
 	}
 }
 
-static void switch_audio_buffers(void) {
-	buffer_index = 1 - buffer_index;
+static struct audio_voice_t *audio_next_voice_to_refill(void) {
+	struct audio_voice_t *next_voice = NULL;
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		struct audio_voice_t *voice = &voices[i];
+		if ((voice->file.file_length == 0) || (voice->stream.fill >= AUDIO_BLOCK_COUNT) || (voice->file.playback_offset == voice->file.file_length) || (voice->file.fileno == AUDIO_LIVE_FILENO)) {
+			/* Idle, ring full, one-shot fetched completely or fed by the host */
+			continue;
+		}
+		if ((next_voice == NULL) || (voice->stream.fill < next_voice->stream.fill)) {
+			next_voice = voice;
+		}
+	}
+	return next_voice;
 }
 
-void audio_playback(unsigned int disk_offset, unsigned int file_length, bool discard_nextbuffer) {
+static bool audio_any_voice_active(void) {
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		if (voices[i].file.file_length != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool audio_cache_wanted(unsigned int file_length, unsigned int loop_start_offset, unsigned int file_offset) {
+	return (file_length <= AUDIO_CACHE_MAX_FILE_LENGTH) || (file_offset == 0) || (file_offset == loop_start_offset);
+}
+
+static bool audio_cache_fetch(unsigned int disk_offset, struct audio_block_t *block) {
+	for (unsigned int i = 0; i < AUDIO_CACHE_BLOCK_COUNT; i++) {
+		if ((cache.slots[i].length == block->length) && (cache.slots[i].disk_offset == disk_offset)) {
+			memcpy(block->data, cache.slots[i].data, block->length);
+			cache.slots[i].last_used = ++cache.clock;
+			stats_cache_hit(block->length);
+			return true;
+		}
+	}
+	stats_cache_miss();
+	return false;
+}
+
+static void audio_cache_store(unsigned int disk_offset, const struct audio_block_t *block) {
+	unsigned int victim = 0;
+	for (unsigned int i = 0; i < AUDIO_CACHE_BLOCK_COUNT; i++) {
+		if ((cache.slots[i].length == block->length) && (cache.slots[i].disk_offset == disk_offset)) {
+			/* Already cached */
+			return;
+		}
+		if (cache.slots[i].length == 0) {
+			victim = i;
+			break;
+		}
+		if (cache.slots[i].last_used < cache.slots[victim].last_used) {
+			victim = i;
+		}
+	}
+	cache.slots[victim].disk_offset = disk_offset;
+	cache.slots[victim].length = block->length;
+	cache.slots[victim].last_used = ++cache.clock;
+	memcpy(cache.slots[victim].data, block->data, block->length);
+}
+
+static bool audio_standby_refill(void) {
+	if ((standby.fileno == -1) || standby.valid) {
+		return false;
+	}
+
+	const unsigned int file_length = present_files[standby.fileno].file_length;
+	standby.block.fileno = standby.fileno;
+	standby.block.file_offset = 0;
+	standby.block.length = (file_length > AUDIO_BLOCK_SIZE) ? AUDIO_BLOCK_SIZE : file_length;
+	standby.block.end_of_file = (standby.block.length == file_length);
+
+	if (audio_cache_fetch(present_files[standby.fileno].begin_disk_offset, &standby.block)) {
+		standby.valid = true;
+		return false;
+	}
+
+	standby.dma_active = true;
+	audio_flash_read(present_files[standby.fileno].begin_disk_offset, standby.block.data, standby.block.length, audio_standby_dma_finished);
+	return true;
+}
+
+static bool audio_file_present(int fileno) {
+	return (fileno >= 0) && (fileno < MAX_FILE_COUNT) && (present_files[fileno].begin_disk_offset != 0xffffffff) && (present_files[fileno].file_length != 0);
+}
+
+static void audio_payload_crc_wait(void) {
+	while (DMA_GetCurrDataCounter(DMA1_Channel1));
+}
+
+static void audio_payload_crc_feed(const struct audio_voice_t *voice, const struct audio_block_t *block) {
+	if ((payload_check.voice == voice) && ((block->file_offset != payload_check.next_offset) || (payload_check.file->begin_disk_offset != voice->file.begin_disk_offset))) {
+		/* Voice has jumped or switched files */
+		payload_check.voice = NULL;
+	}
+	if (!payload_check.voice) {
+		if ((block->file_offset != 0) || !audio_file_present(voice->file.fileno)) {
+			return;
+		}
+		struct audio_file_info_t *file = &present_files[voice->file.fileno];
+		if (!file->payload_crc_present || file->payload_crc_verified) {
+			return;
+		}
+		audio_payload_crc_wait();
+		payload_check.voice = voice;
+		payload_check.file = file;
+		payload_check.next_offset = 0;
+		CRC_ResetDR();
+	} else if (payload_check.voice != voice) {
+		return;
+	}
+
+	const unsigned int word_count = block->length / 4;
+	audio_payload_crc_wait();
+	if (word_count) {
+		DMA_Channel_TypeDef *dma_channel = DMA1_Channel1;
+		DMA_Cmd(dma_channel, DISABLE);
+		dma_channel->CMAR = (uint32_t)block->data;
+		dma_channel->CNDTR = word_count;
+		DMA_Cmd(dma_channel, ENABLE);
+	}
+	payload_check.next_offset += block->length;
+	if (!block->end_of_file) {
+		return;
+	}
+
+	/* The last word is zero padded */
+	audio_payload_crc_wait();
+	if (block->length % 4) {
+		uint32_t tail = 0;
+		memcpy(&tail, block->data + (4 * word_count), block->length % 4);
+		CRC_CalcCRC(tail);
+	}
+	if (CRC_GetCRC() == payload_check.file->payload_crc) {
+		payload_check.file->payload_crc_verified = true;
+		stats_payload_crc_ok();
+	} else {
+		/* Checked again on the next play */
+		stats_payload_crc_failed();
+	}
+	payload_check.voice = NULL;
+}
+
+/* The block behind the last filled one in the ring has arrived */
+static void audio_stream_block_complete(struct audio_voice_t *voice) {
+	struct audio_stream_t *stream = &voice->stream;
+	const struct audio_block_t *block = &stream->blocks[(stream->read_index + stream->fill) % AUDIO_BLOCK_COUNT];
+	audio_payload_crc_feed(voice, block);
+	stream->fill++;
+	voice->file.playback_offset += block->length;
+	if (block->end_of_file && !voice->one_shot) {
+		voice->file.playback_offset = voice->file.loop_start_offset;
+	}
+}
+
+static void audio_stream_refill(void) {
+	if (dma_voice || standby.dma_active) {
+		return;
+	}
+
+	while (true) {
+		struct audio_voice_t *voice = audio_next_voice_to_refill();
+		if (!voice) {
+			/* All rings are full, use the bus for the standby block */
+			if (!audio_standby_refill() && !audio_any_voice_active()) {
+				/* Nothing to play, release the bus */
+				spiflash_stream_close();
+			}
+			return;
+		}
+
+		struct audio_stream_t *stream = &voice->stream;
+		struct active_audio_file_t *file = &voice->file;
+		unsigned int write_index = (stream->read_index + stream->fill) % AUDIO_BLOCK_COUNT;
+		struct audio_block_t *block = &stream->blocks[write_index];
+		stats_audio_refill(stream->fill);
+
+		/* How many bytes has the sample left and how many fit in the block? */
+		unsigned int remaining_bytes = file->file_length - file->playback_offset;
+		unsigned int fetch_bytes = (remaining_bytes > AUDIO_BLOCK_SIZE) ? AUDIO_BLOCK_SIZE : remaining_bytes;
+
+		block->fileno = file->fileno;
+		block->file_offset = file->playback_offset;
+		block->length = fetch_bytes;
+		block->end_of_file = (fetch_bytes == remaining_bytes);
+
+		const unsigned int disk_offset = file->begin_disk_offset + file->playback_offset;
+		if (audio_cache_wanted(file->file_length, file->loop_start_offset, block->file_offset) && audio_cache_fetch(disk_offset, block)) {
+			/* Served from SRAM, go on with the next block right away */
+			audio_stream_block_complete(voice);
+			continue;
+		}
+
+		dma_voice = voice;
+		audio_flash_read(disk_offset, block->data, fetch_bytes, audio_stream_dma_finished);
+		return;
+	}
+}
+
+static void audio_stream_dma_finished(struct spiflash_transaction_t *transaction) {
+	const enum dma_state_t dma_state = transaction->state;
+	struct audio_voice_t *voice = dma_voice;
+	struct audio_stream_t *stream = &voice->stream;
+	dma_voice = NULL;
+	audio_dma_completed(dma_state);
+	if (stream->discard_dma) {
+		/* Voice was restarted while this block was in flight, drop it. */
+		stream->discard_dma = false;
+	} else if (dma_state == DMA_SUCCESS) {
+		const struct active_audio_file_t *file = &voice->file;
+		const struct audio_block_t *block = &stream->blocks[(stream->read_index + stream->fill) % AUDIO_BLOCK_COUNT];
+		if (audio_cache_wanted(file->file_length, file->loop_start_offset, block->file_offset)) {
+			audio_cache_store(file->begin_disk_offset + block->file_offset, block);
+		}
+		audio_stream_block_complete(voice);
+	} else {
+		/* DMA seems to have errored, the block is simply requested again. */
+	}
+	audio_stream_refill();
+}
+
+static void audio_standby_dma_finished(struct spiflash_transaction_t *transaction) {
+	const enum dma_state_t dma_state = transaction->state;
+	standby.dma_active = false;
+	audio_dma_completed(dma_state);
+	if (standby.discard_dma) {
+		/* Another clip was requested meanwhile */
+		standby.discard_dma = false;
+	} else if (dma_state == DMA_SUCCESS) {
+		standby.valid = true;
+		audio_cache_store(present_files[standby.fileno].begin_disk_offset, &standby.block);
+	}
+	audio_stream_refill();
+}
+
+void audio_prefetch(int fileno) {
+	if ((fileno < 0) || (fileno >= MAX_FILE_COUNT) || (present_files[fileno].begin_disk_offset == 0xffffffff) || (present_files[fileno].file_length == 0)) {
+		return;
+	}
+	if (standby.fileno == fileno) {
+		return;
+	}
+
+	__disable_irq();
+	standby.fileno = fileno;
+	standby.valid = false;
+	if (standby.dma_active) {
+		standby.discard_dma = true;
+	}
+	audio_stream_refill();
+	__enable_irq();
+}
+
+/* Start the stream of a freshly restarted voice with the standby block if it
+ * holds the head of that very file. */
+static void audio_voice_take_standby(struct audio_voice_t *voice) {
+	struct audio_stream_t *stream = &voice->stream;
+	if (!standby.valid || (standby.fileno != voice->file.fileno)) {
+		/* Only a mispredicted or late prefetch is a miss, not a start
+		 * without any */
+		if (standby.fileno != -1) {
+			stats_prefetch_miss();
+		}
+		return;
+	}
+
+	stream->blocks[stream->read_index] = standby.block;
+	audio_payload_crc_feed(voice, &stream->blocks[stream->read_index]);
+	stream->fill = 1;
+	voice->file.playback_offset = (standby.block.end_of_file && !voice->one_shot) ? voice->file.loop_start_offset : standby.block.length;
+	stats_prefetch_hit();
+}
+
+static void audio_update_output_rate(void) {
+	unsigned int sample_rate = 0;
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		if ((voices[i].file.file_length != 0) && (voices[i].file.sample_rate > sample_rate)) {
+			sample_rate = voices[i].file.sample_rate;
+		}
+	}
+	if (sample_rate == 0) {
+		/* Keep the current rate while nothing plays */
+		return;
+	}
+
+	output.requested_rate = sample_rate;
+#ifdef AUDIO_OUTPUT_DMA
+	const bool switch_immediately = !output.active;
+#else
+	const bool switch_immediately = true;
+#endif
+	if (switch_immediately && (output.requested_rate != output.sample_rate)) {
+		audio_apply_output_rate();
+		output.pending_reload = 0;
+		TIM2->ARR = audio_rate_to_reload(output.sample_rate);
+	}
+}
+
+static void audio_stream_reset(struct audio_voice_t *voice) {
+	struct audio_stream_t *stream = &voice->stream;
+	if ((dma_voice == voice) && !stream->discard_dma) {
+		/* Block in flight is dropped; keep the read index clear of it since
+		 * the DMA is still writing there */
+		stream->discard_dma = true;
+		stream->read_index = (stream->read_index + stream->fill + 1) % AUDIO_BLOCK_COUNT;
+	}
+	stream->fill = 0;
+	stream->read_offset = 0;
+	if (payload_check.voice == voice) {
+		/* Stream is gone, free the CRC unit for other files */
+		payload_check.voice = NULL;
+	}
+}
+
+static void audio_voice_set_next_cue(struct audio_voice_t *voice, unsigned int cue_index) {
+	voice->next_cue = cue_index;
+	voice->next_cue_position = (cue_index < voice->file.cue_count) ? voice->file.cues[cue_index] : AUDIO_NO_CUE;
+}
+
+static void audio_voice_restart(struct audio_voice_t *voice, unsigned int disk_offset, unsigned int file_length, bool discard_nextbuffer) {
 	if (discard_nextbuffer) {
-		struct audio_buffer_t *next_buffer = get_next_audio_buffer();
-		next_buffer->valid = false;
+		audio_stream_reset(voice);
+	} else if (dma_voice == voice) {
+		/* Block in flight still belongs to the previous file */
+		voice->stream.discard_dma = true;
 	}
-	audio_file.playback_offset = 0;
-	audio_file.begin_disk_offset = disk_offset;
-	audio_file.file_length = file_length;
-	TIM_ITConfig(TIM2, TIM_IT_CC1, ENABLE);
+	voice->file.playback_offset = 0;
+	voice->file.begin_disk_offset = disk_offset;
+	voice->file.file_length = file_length;
+	voice->position = 0;
+	voice->adpcm.high_nibble = false;
+	voice->silence.next_run = 0;
+	voice->silence.remaining = 0;
+	voice->silence.end_of_file = false;
+	audio_voice_set_next_cue(voice, 0);
+	voice->phase = AUDIO_PHASE_ONE;
+	voice->previous_sample = 0;
+	voice->current_sample = 0;
+	audio_voice_update_step(voice);
+	audio_update_output_rate();
+}
+
+static void audio_voice_stop(struct audio_voice_t *voice) {
+	voice->file.fileno = -1;
+	voice->file.file_length = 0;
+	audio_stream_reset(voice);
+}
+
+void audio_playback(unsigned int disk_offset, unsigned int file_length, bool discard_nextbuffer) {
+	__disable_irq();
+	voices[VOICE_ENGINE].file.codec = CODEC_PCM_U8;
+	voices[VOICE_ENGINE].file.light_track = false;
+	voices[VOICE_ENGINE].file.sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+	voices[VOICE_ENGINE].file.loop_start_offset = 0;
+	voices[VOICE_ENGINE].file.loop_start_position = 0;
+	voices[VOICE_ENGINE].file.silence_run_count = 0;
+	voices[VOICE_ENGINE].file.cue_count = 0;
+	audio_voice_restart(&voices[VOICE_ENGINE], disk_offset, file_length, discard_nextbuffer);
+	audio_stream_refill();
+	__enable_irq();
+	audio_output_start();
+}
+
+static void audio_voice_start_file(struct audio_voice_t *voice, int fileno, bool one_shot) {
+	voice->synth.tones = NULL;
+	voice->one_shot = one_shot;
+	voice->file.fileno = fileno;
+	voice->file.codec = present_files[fileno].codec;
+	voice->file.light_track = present_files[fileno].light_track;
+	voice->file.sample_rate = present_files[fileno].sample_rate;
+	voice->file.loop_start_offset = present_files[fileno].loop_start_offset;
+	voice->file.loop_start_position = present_files[fileno].loop_start_position;
+	voice->file.silence_runs = present_files[fileno].silence_runs;
+	voice->file.silence_run_count = present_files[fileno].silence_run_count;
+	voice->file.cues = present_files[fileno].cues;
+	voice->file.cue_count = present_files[fileno].cue_count;
+	audio_voice_restart(voice, present_files[fileno].begin_disk_offset, present_files[fileno].file_length, true);
+	audio_voice_take_standby(voice);
+	audio_stream_refill();
+}
+
+void audio_voice_play(enum audio_voice_no_t voice_no, int fileno) {
+	struct audio_voice_t *voice = &voices[voice_no];
+	if (!audio_file_present(fileno)) {
+		if ((voice->file.fileno != -1) || (voice->sequence.fileno != -1)) {
+			__disable_irq();
+			voice->sequence.fileno = -1;
+			audio_voice_stop(voice);
+			audio_update_output_rate();
+			audio_stream_refill();
+			__enable_irq();
+		}
+	} else if ((voice->file.fileno != fileno) || voice->one_shot || (voice->sequence.fileno != -1)) {
+		__disable_irq();
+		voice->sequence.fileno = -1;
+		audio_voice_start_file(voice, fileno, false);
+		__enable_irq();
+		audio_output_start();
+	}
+}
+
+void audio_voice_set_gain(enum audio_voice_no_t voice_no, unsigned int gain) {
+	voices[voice_no].gain = gain;
+}
+
+void audio_voice_set_pitch(enum audio_voice_no_t voice_no, unsigned int pitch) {
+	/* Q8 playback speed, 0.5x to 2x */
+	if (pitch < AUDIO_PITCH_MIN) {
+		pitch = AUDIO_PITCH_MIN;
+	} else if (pitch > AUDIO_PITCH_MAX) {
+		pitch = AUDIO_PITCH_MAX;
+	}
+	__disable_irq();
+	voices[voice_no].pitch = pitch;
+	audio_voice_update_step(&voices[voice_no]);
+	__enable_irq();
+}
+
+int audio_voice_fileno(enum audio_voice_no_t voice_no) {
+	return voices[voice_no].file.fileno;
+}
+
+bool audio_file_has_intro(unsigned int fileno) {
+	return (fileno < MAX_FILE_COUNT) && (present_files[fileno].begin_disk_offset != 0xffffffff) && (present_files[fileno].loop_start_position != 0);
 }
 
 void audio_playback_fileno(unsigned int fileno, bool discard_nextbuffer) {
-	if ((fileno > MAX_FILE_COUNT) || (present_files[fileno].begin_disk_offset == 0xffffffff)) {
+	if ((fileno >= MAX_FILE_COUNT) || (present_files[fileno].begin_disk_offset == 0xffffffff) || (present_files[fileno].file_length == 0)) {
 		audio_shutoff();
 	} else {
-		if (audio_file.fileno != fileno) {
-			audio_playback(present_files[fileno].begin_disk_offset, present_files[fileno].file_length, discard_nextbuffer);
-			audio_file.fileno = fileno;
-			if ((fileno == FILENO_TURN_SIGNAL_WITH_ENGINE) || (fileno == FILENO_TURN_SIGNAL_NO_ENGINE)) {
-				trigger_point_index = 0;
-				trigger_point = 65 + 4079 * trigger_point_index;
-			} else {
-				trigger_point = -1;
+		audio_voice_play(VOICE_ENGINE, fileno);
+	}
+}
+
+unsigned int audio_file_cue_count(unsigned int fileno) {
+	if ((fileno >= MAX_FILE_COUNT) || (present_files[fileno].begin_disk_offset == 0xffffffff)) {
+		return 0;
+	}
+	return present_files[fileno].cue_count;
+}
+
+static void audio_voice_execute_cue(struct audio_voice_t *voice) {
+	const unsigned int cue_index = voice->next_cue;
+	audio_voice_set_next_cue(voice, cue_index + 1);
+	audio_trigger_cue_point(voice->file.fileno, cue_index);
+}
+
+/* Straight-line IMA-ADPCM decode of a single nibble: one table lookup each
+ * for step size and index delta, three conditional adds and two clamps,
+ * about 20 instructions per sample. */
+static int16_t ima_adpcm_decode_nibble(struct ima_adpcm_state_t *state, unsigned int nibble) {
+	const int32_t step = ima_adpcm_step_table[state->step_index];
+	int32_t diff = step >> 3;
+	if (nibble & 4) {
+		diff += step;
+	}
+	if (nibble & 2) {
+		diff += step >> 1;
+	}
+	if (nibble & 1) {
+		diff += step >> 2;
+	}
+	if (nibble & 8) {
+		diff = -diff;
+	}
+	state->predictor = ssat16(state->predictor + diff);
+
+	int step_index = state->step_index + ima_adpcm_index_table[nibble];
+	if (step_index < 0) {
+		step_index = 0;
+	} else if (step_index > 88) {
+		step_index = 88;
+	}
+	state->step_index = step_index;
+	return state->predictor;
+}
+
+static void audio_light_push(uint8_t state) {
+	if (light_queue.fill == AUDIO_LIGHT_QUEUE_SIZE) {
+		/* Main loop is lagging, drop the oldest state */
+		light_queue.read_index = (light_queue.read_index + 1) % AUDIO_LIGHT_QUEUE_SIZE;
+		light_queue.fill--;
+	}
+	unsigned int write_index = (light_queue.read_index + light_queue.fill) % AUDIO_LIGHT_QUEUE_SIZE;
+	light_queue.events[write_index].timestamp = output.render_clock;
+	light_queue.events[write_index].state = state;
+	light_queue.fill++;
+}
+
+static uint32_t audio_output_played_clock(void) {
+#ifdef AUDIO_OUTPUT_DMA
+	/* The half the DMA currently plays was rendered one half before the
+	 * latest one, i.e., it starts at render_clock - AUDIO_OUTPUT_BUFFER_SIZE */
+	const unsigned int dma_index = AUDIO_OUTPUT_BUFFER_SIZE - DMA1_Channel5->CNDTR;
+	return output.render_clock - AUDIO_OUTPUT_BUFFER_SIZE + (dma_index % (AUDIO_OUTPUT_BUFFER_SIZE / 2));
+#else
+	return output.render_clock;
+#endif
+}
+
+bool audio_light_poll(uint8_t *light_state) {
+	bool have_state = false;
+	__disable_irq();
+	const uint32_t played_clock = audio_output_played_clock();
+	while (light_queue.fill && ((int32_t)(light_queue.events[light_queue.read_index].timestamp - played_clock) <= 0)) {
+		*light_state = light_queue.events[light_queue.read_index].state;
+		have_state = true;
+		light_queue.read_index = (light_queue.read_index + 1) % AUDIO_LIGHT_QUEUE_SIZE;
+		light_queue.fill--;
+	}
+	__enable_irq();
+	return have_state;
+}
+
+bool audio_light_track_active(void) {
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		if (voices[i].synth.tones || ((voices[i].file.file_length != 0) && voices[i].file.light_track)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int16_t audio_voice_decode_sample(struct audio_voice_t *voice, const struct audio_block_t *block) {
+	struct audio_stream_t *stream = &voice->stream;
+	unsigned int unit_header_size = 0;
+	if (voice->file.light_track) {
+		unit_header_size = 1;
+		if (!voice->adpcm.high_nibble && ((stream->read_offset % AUDIO_LIGHT_UNIT_SIZE) == 0)) {
+			audio_light_push(block->data[stream->read_offset]);
+			stream->read_offset++;
+		}
+	}
+
+	if (voice->file.codec == CODEC_IMA_ADPCM) {
+		struct ima_adpcm_state_t *adpcm = &voice->adpcm;
+		if (!adpcm->high_nibble && ((stream->read_offset % IMA_ADPCM_BLOCK_SIZE) == unit_header_size)) {
+			/* Start of ADPCM block, load the decoder state from its header */
+			const uint8_t *header = block->data + stream->read_offset;
+			adpcm->predictor = (int16_t)(header[0] | (header[1] << 8));
+			adpcm->step_index = (header[2] > 88) ? 88 : header[2];
+			adpcm->padding_nibble = header[3] & IMA_ADPCM_FLAG_PADDING_NIBBLE;
+			stream->read_offset += IMA_ADPCM_HEADER_SIZE;
+		}
+
+		const uint8_t data = block->data[stream->read_offset];
+		unsigned int nibble;
+		if (adpcm->high_nibble) {
+			nibble = data >> 4;
+			stream->read_offset++;
+		} else {
+			nibble = data & 0xf;
+			if (adpcm->padding_nibble && block->end_of_file && (stream->read_offset + 1 == block->length)) {
+				/* Odd sample count, skip the unused high nibble */
+				stream->read_offset++;
+				adpcm->high_nibble = true;
 			}
 		}
+		adpcm->high_nibble = !adpcm->high_nibble;
+		return ima_adpcm_decode_nibble(adpcm, nibble);
+	} else {
+		const uint8_t data = block->data[stream->read_offset];
+		stream->read_offset++;
+		return (data - 128) << 8;
 	}
 }
 
-static void audio_check_audio_buffers(void) {
-	struct audio_buffer_t *next_buffer = get_next_audio_buffer();
-	if (next_buffer->valid) {
+static bool audio_voice_silence_starts(struct audio_voice_t *voice, unsigned int data_offset) {
+	struct audio_silence_state_t *silence = &voice->silence;
+	if (silence->next_run >= voice->file.silence_run_count) {
+		return false;
+	}
+	const struct audio_silence_run_t *run = &voice->file.silence_runs[silence->next_run];
+	if (run->data_offset != data_offset) {
+		return false;
+	}
+	silence->next_run++;
+	silence->remaining = run->sample_count;
+	silence->end_of_file = (data_offset == voice->file.file_length);
+	return silence->remaining != 0;
+}
+
+static void audio_voice_end_of_file(struct audio_voice_t *voice, int fileno) {
+	if (voice->one_shot) {
+		/* Nothing more was fetched, the voice falls silent */
+		audio_voice_stop(voice);
+		audio_update_output_rate();
+		audio_trigger_end_of_sample(fileno);
 		return;
 	}
 
-	if (filling_action == IDLE) {
- 		/* Not filling right now, start a fill */
-		/* How many bytes has the sample left? */
-		unsigned int remaining_bytes = audio_file.file_length - audio_file.playback_offset;
+	/* Wrap to the loop start; the stream already continues from there */
+	voice->position = voice->file.loop_start_position;
+	voice->silence.next_run = 0;
+	while ((voice->silence.next_run < voice->file.silence_run_count) && (voice->file.silence_runs[voice->silence.next_run].data_offset < voice->file.loop_start_offset)) {
+		voice->silence.next_run++;
+	}
+	unsigned int cue_index = 0;
+	while ((cue_index < voice->file.cue_count) && (voice->file.cues[cue_index] < voice->file.loop_start_position)) {
+		cue_index++;
+	}
+	audio_voice_set_next_cue(voice, cue_index);
+	audio_trigger_end_of_sample(fileno);
+}
 
-		/* How many should we fetch for the next buffer? */
-		unsigned int fetch_bytes = (remaining_bytes > AUDIO_BUFFER_SIZE) ? AUDIO_BUFFER_SIZE : remaining_bytes;
+static void audio_voice_advance_position(struct audio_voice_t *voice) {
+	if (voice->position == voice->next_cue_position) {
+		audio_voice_execute_cue(voice);
+	}
+	voice->position++;
+}
 
-		unsigned int disk_offset = audio_file.begin_disk_offset + audio_file.playback_offset;
-		next_buffer->samples_total = 4 + fetch_bytes;
-		next_buffer->data[0] = SPIFLASH_READ_DATA;
-		next_buffer->data[1] = (disk_offset >> 16) & 0xff;
-		next_buffer->data[2] = (disk_offset >> 8) & 0xff;
-		next_buffer->data[3] = (disk_offset >> 0) & 0xff;
+static int16_t audio_voice_fetch_sample(struct audio_voice_t *voice) {
+	struct audio_stream_t *stream = &voice->stream;
+	struct audio_block_t *block = &stream->blocks[stream->read_index];
+	if ((voice->silence.remaining == 0) && (stream->fill != 0)) {
+		audio_voice_silence_starts(voice, block->file_offset + stream->read_offset);
+	}
 
-		/* Then fire off the DMA request */
-		spiflash_txrx_dma(next_buffer->data, next_buffer->samples_total);
+	if (voice->silence.remaining) {
+		/* Elided silence, nothing to fetch from the ring */
+		voice->silence.remaining--;
+		audio_voice_advance_position(voice);
+		if ((voice->silence.remaining == 0) && voice->silence.end_of_file) {
+			voice->silence.end_of_file = false;
+			audio_voice_end_of_file(voice, voice->file.fileno);
+		}
+		return 0;
+	}
 
-		/* And memorize we're trying to fill the next buffer */
-		filling_action = FILLING;
-	} else {
-		/* Was filling, check if DMA is finished */
-		enum dma_state_t dma_state = spiflash_get_dma_state();
-		if (dma_state == DMA_SUCCESS) {
-			/* Finished successfully. */
-			next_buffer->offset = 4;
-			next_buffer->absolute_offset = audio_file.playback_offset;
-			next_buffer->valid = true;
-			audio_file.playback_offset += next_buffer->samples_total - 4;
-			if (audio_file.playback_offset >= audio_file.file_length) {
-				audio_file.playback_offset = 0;
-				audio_trigger_end_of_sample(audio_file.fileno);
-			}
-			filling_action = IDLE;
-		} else if (dma_state == DMA_IN_PROGRESS) {
-			/* Just keep waiting. */
+	if (stream->fill == 0) {
+		/* Underrun or voice inactive, DMA has not caught up yet. */
+		if (voice->file.file_length != 0) {
+			stats_audio_underrun();
+		}
+		return 0;
+	}
+
+	int16_t returned_sample = audio_voice_decode_sample(voice, block);
+	audio_voice_advance_position(voice);
+	if (stream->read_offset >= block->length) {
+		/* Block consumed, hand it back to the DMA. A trailing silence run
+		 * postpones the end of file. */
+		stream->read_offset = 0;
+		stream->read_index = (stream->read_index + 1) % AUDIO_BLOCK_COUNT;
+		stream->fill--;
+		if (block->end_of_file && !audio_voice_silence_starts(voice, voice->file.file_length)) {
+			audio_voice_end_of_file(voice, block->fileno);
+		}
+		audio_stream_refill();
+	}
+
+	return returned_sample;
+}
+
+static int16_t audio_voice_next_sample(struct audio_voice_t *voice) {
+	/* Advance through the source samples at the voice's own rate times its
+	 * pitch, then interpolate linearly between the two samples the output
+	 * position lies between. The difference is at most 17 bits and the
+	 * fraction is cut to 15 bits so the product fits into 32 bits. Besides
+	 * the sample fetches this is one multiply and a handful of ALU
+	 * instructions, some 20 cycles per voice; even at 2x pitch (two fetches
+	 * per output sample) and 44.1 kHz the three voices stay well inside the
+	 * 1632 cycles available per output sample at 72 MHz. */
+	while (voice->phase >= AUDIO_PHASE_ONE) {
+		voice->phase -= AUDIO_PHASE_ONE;
+		voice->previous_sample = voice->current_sample;
+		voice->current_sample = audio_voice_fetch_sample(voice);
+	}
+	const int32_t delta = voice->current_sample - voice->previous_sample;
+	const int32_t sample = voice->previous_sample + ((delta * (int32_t)(voice->phase >> 1)) >> 15);
+	voice->phase += voice->step;
+	return sample;
+}
+
+static void audio_synth_start_tone(struct audio_voice_t *voice, unsigned int tone_index) {
+	const struct audio_synth_tone_t *tone = &voice->synth.tones[tone_index];
+	voice->synth.tone_index = tone_index;
+	voice->synth.remaining = ((uint64_t)tone->duration_ms * output.sample_rate * AUDIO_SYNTH_FACTOR_UNITY) / (1000 * synth_tempo);
+	if (voice->synth.remaining == 0) {
+		/* Too short for the tempo, would wrap around when counted down */
+		voice->synth.remaining = 1;
+	}
+	audio_synth_update_step(voice);
+	audio_light_push(tone->light_state);
+}
+
+static int16_t audio_synth_next_sample(struct audio_voice_t *voice) {
+	struct audio_synth_t *synth = &voice->synth;
+	if (synth->remaining == 0) {
+		audio_synth_start_tone(voice, (synth->tone_index + 1) % synth->tone_count);
+	}
+	synth->remaining--;
+
+	const unsigned int index = synth->phase >> (32 - AUDIO_SYNTH_TABLE_BITS);
+	const int32_t fraction = (synth->phase >> (32 - AUDIO_SYNTH_TABLE_BITS - 8)) & 0xff;
+	const int32_t sample0 = synth_wavetable[index];
+	const int32_t sample1 = synth_wavetable[(index + 1) % (1 << AUDIO_SYNTH_TABLE_BITS)];
+	synth->phase += synth->step;
+	return sample0 + (((sample1 - sample0) * fraction) >> 8);
+}
+
+void audio_voice_play_synth(enum audio_voice_no_t voice_no, const struct audio_synth_tone_t *tones, unsigned int tone_count) {
+	struct audio_voice_t *voice = &voices[voice_no];
+	if (tone_count == 0) {
+		tones = NULL;
+	}
+	if (voice->synth.tones == tones) {
+		return;
+	}
+
+	__disable_irq();
+	voice->sequence.fileno = -1;
+	if (voice->file.fileno != -1) {
+		audio_voice_stop(voice);
+		audio_update_output_rate();
+		audio_stream_refill();
+	}
+	voice->synth.tones = tones;
+	voice->synth.tone_count = tone_count;
+	voice->synth.phase = 0;
+	if (tones) {
+		audio_synth_start_tone(voice, 0);
+	}
+	__enable_irq();
+	if (tones) {
+		audio_output_start();
+	}
+}
+
+void audio_synth_set_pitch(unsigned int pitch) {
+	__disable_irq();
+	synth_pitch = pitch;
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		audio_synth_update_step(&voices[i]);
+	}
+	__enable_irq();
+}
+
+void audio_synth_set_tempo(unsigned int tempo) {
+	/* Takes effect with the next tone */
+	synth_tempo = (tempo == 0) ? 1 : tempo;
+}
+
+static void audio_sequencer_update_next(void) {
+	/* Earliest pending event; if there is none, the clock only comes around
+	 * again after 2^32 samples and audio_sequencer_run() then finds nothing. */
+	uint32_t earliest = ~0u;
+	sequencer_next_clock = output.render_clock - 1;
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		const struct audio_sequence_t *sequence = &voices[i].sequence;
+		if (sequence->fileno == -1) {
+			continue;
+		}
+		int32_t distance = sequence->next_clock - output.render_clock;
+		if (distance < 0) {
+			/* Overdue, play right away */
+			distance = 0;
+		}
+		if ((uint32_t)distance < earliest) {
+			earliest = distance;
+			sequencer_next_clock = output.render_clock + distance;
+		}
+	}
+}
+
+static void audio_sequencer_run(void) {
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		struct audio_voice_t *voice = &voices[i];
+		struct audio_sequence_t *sequence = &voice->sequence;
+		if ((sequence->fileno == -1) || ((int32_t)(output.render_clock - sequence->next_clock) < 0)) {
+			continue;
+		}
+		const int fileno = sequence->fileno;
+		if (sequence->interval) {
+			sequence->next_clock += sequence->interval;
 		} else {
-			/* DMA seems to have errored, retry next time. */
-			filling_action = IDLE;
+			sequence->fileno = -1;
 		}
+		audio_voice_start_file(voice, fileno, true);
+		audio_trigger_sequence_step(fileno);
 	}
+	audio_sequencer_update_next();
 }
 
-int audio_current_fileno(void) {
-	return audio_file.fileno;
+void audio_sequence_play(enum audio_voice_no_t voice_no, int fileno, uint32_t clock, unsigned int interval) {
+	/* If the voice already sequences that file, only the interval changes */
+	struct audio_voice_t *voice = &voices[voice_no];
+	if (!audio_file_present(fileno)) {
+		return;
+	}
+
+	__disable_irq();
+	if (voice->sequence.fileno != fileno) {
+		voice->sequence.fileno = fileno;
+		voice->sequence.next_clock = clock;
+	}
+	voice->sequence.interval = interval;
+	audio_sequencer_update_next();
+	__enable_irq();
+	audio_output_start();
+}
+
+int audio_voice_sequence_fileno(enum audio_voice_no_t voice_no) {
+	return voices[voice_no].sequence.fileno;
+}
+
+uint32_t audio_output_clock(void) {
+	return output.render_clock;
+}
+
+unsigned int audio_output_sample_rate(void) {
+	return output.sample_rate;
 }
 
-static void audio_execute_trigger_point(void) {
-	trigger_point_index += 1;
-	if (trigger_point_index >= 12) {
-		trigger_point_index = 0;
+bool audio_live_start(unsigned int sample_rate, unsigned int codec) {
+	if ((sample_rate < AUDIO_MIN_SAMPLE_RATE) || (sample_rate > AUDIO_MAX_SAMPLE_RATE) || ((codec != CODEC_PCM_U8) && (codec != CODEC_IMA_ADPCM))) {
+		return false;
 	}
-	trigger_point = 65 + 4079 * trigger_point_index;
 
-	audio_trigger_point();
+	struct audio_voice_t *voice = &voices[AUDIO_LIVE_VOICE];
+	__disable_irq();
+	voice->sequence.fileno = -1;
+	voice->synth.tones = NULL;
+	voice->one_shot = true;
+	voice->file.fileno = AUDIO_LIVE_FILENO;
+	voice->file.codec = codec;
+	voice->file.light_track = false;
+	voice->file.sample_rate = sample_rate;
+	voice->file.loop_start_offset = 0;
+	voice->file.loop_start_position = 0;
+	voice->file.silence_runs = NULL;
+	voice->file.silence_run_count = 0;
+	voice->file.cues = NULL;
+	voice->file.cue_count = 0;
+	audio_voice_restart(voice, 0, ~0u, true);
+	live.active = true;
+	live.partial = 0;
+	__enable_irq();
+	audio_output_start();
+	return true;
 }
 
-uint8_t audio_next_sample(void) {
-	audio_check_audio_buffers();
+static bool audio_live_writable(const struct audio_voice_t *voice) {
+	/* A discarded DMA may still write into the ring right after the start */
+	return live.active && (voice->file.fileno == AUDIO_LIVE_FILENO) && (dma_voice != voice);
+}
+
+static void audio_live_commit(struct audio_voice_t *voice, bool end_of_file) {
+	struct audio_stream_t *stream = &voice->stream;
+	struct audio_block_t *block = &stream->blocks[(stream->read_index + stream->fill) % AUDIO_BLOCK_COUNT];
+	block->fileno = AUDIO_LIVE_FILENO;
+	block->file_offset = voice->file.playback_offset;
+	block->length = live.partial;
+	block->end_of_file = end_of_file;
+	live.partial = 0;
+	audio_stream_block_complete(voice);
+}
+
+unsigned int audio_live_write(const uint8_t *data, unsigned int length) {
+	struct audio_voice_t *voice = &voices[AUDIO_LIVE_VOICE];
+	struct audio_stream_t *stream = &voice->stream;
+	unsigned int accepted = 0;
+	if (!audio_live_writable(voice)) {
+		return 0;
+	}
+
+	while ((accepted < length) && (stream->fill < AUDIO_BLOCK_COUNT)) {
+		struct audio_block_t *block = &stream->blocks[(stream->read_index + stream->fill) % AUDIO_BLOCK_COUNT];
+		unsigned int chunk = AUDIO_BLOCK_SIZE - live.partial;
+		if (chunk > length - accepted) {
+			chunk = length - accepted;
+		}
+		memcpy(block->data + live.partial, data + accepted, chunk);
+		live.partial += chunk;
+		accepted += chunk;
+		if (live.partial == AUDIO_BLOCK_SIZE) {
+			audio_live_commit(voice, false);
+		}
+	}
+	return accepted;
+}
+
+unsigned int audio_live_credits(void) {
+	const struct audio_voice_t *voice = &voices[AUDIO_LIVE_VOICE];
+	if (!audio_live_writable(voice)) {
+		return 0;
+	}
+	return ((AUDIO_BLOCK_COUNT - voice->stream.fill) * AUDIO_BLOCK_SIZE) - live.partial;
+}
+
+void audio_live_stop(void) {
+	/* Whatever has been received is played to its end */
+	struct audio_voice_t *voice = &voices[AUDIO_LIVE_VOICE];
+	struct audio_stream_t *stream = &voice->stream;
+	if (!live.active) {
+		return;
+	}
+	live.active = false;
+	if (voice->file.fileno != AUDIO_LIVE_FILENO) {
+		return;
+	}
+
+	__disable_irq();
+	if (live.partial) {
+		audio_live_commit(voice, true);
+	} else if (stream->fill) {
+		stream->blocks[(stream->read_index + stream->fill - 1) % AUDIO_BLOCK_COUNT].end_of_file = true;
+	} else {
+		audio_voice_stop(voice);
+		audio_update_output_rate();
+	}
+	__enable_irq();
+}
 
-	struct audio_buffer_t *current_buffer = get_current_audio_buffer();
-	if (!current_buffer->valid) {
-		struct audio_buffer_t *next_buffer = get_next_audio_buffer();
-		if (!next_buffer->valid) {
-			return 0;
+bool audio_select_bank(unsigned int bank) {
+	if (bank >= bank_directory.count) {
+		return false;
+	}
+
+	__disable_irq();
+	bank_directory.active = bank;
+	present_files = bank_directory.banks[bank].files;
+	if (standby.dma_active) {
+		standby.discard_dma = true;
+	}
+	standby.fileno = -1;
+	standby.valid = false;
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		/* Same file number from the new bank; sequences pick it up with
+		 * their next step */
+		struct audio_voice_t *voice = &voices[i];
+		const int fileno = voice->file.fileno;
+		if ((fileno < 0) || (fileno >= MAX_FILE_COUNT)) {
+			continue;
+		}
+		if (audio_file_present(fileno)) {
+			audio_voice_start_file(voice, fileno, voice->one_shot);
+		} else {
+			audio_voice_stop(voice);
+		}
+	}
+	audio_update_output_rate();
+	audio_stream_refill();
+	__enable_irq();
+	return true;
+}
+
+unsigned int audio_bank_count(void) {
+	return bank_directory.count;
+}
+
+unsigned int audio_active_bank(void) {
+	return bank_directory.active;
+}
+
+const char *audio_bank_name(unsigned int bank) {
+	return (bank < bank_directory.count) ? bank_directory.banks[bank].name : NULL;
+}
+
+/* Binary search of the name hash in the index of the active bank's TOC, then
+ * the names of all entries with that hash are compared. Returns the entry
+ * number or -1; only entries below MAX_FILE_COUNT can be played. */
+int audio_file_lookup(const char *name) {
+	const unsigned int image_offset = bank_directory.banks[bank_directory.active].image_offset;
+	const unsigned int entry_count = bank_directory.banks[bank_directory.active].toc_entry_count;
+	const unsigned int index_offset = image_offset + sizeof(struct audio_toc_header_t) + (sizeof(struct audio_toc_entry_t) * entry_count);
+	const uint32_t name_hash = compute_crc32(name, strlen(name));
+	struct audio_toc_index_entry_t index_entry;
+
+	unsigned int low = 0;
+	unsigned int high = entry_count;
+	while (low < high) {
+		const unsigned int mid = (low + high) / 2;
+		spiflash_read(index_offset + (sizeof(index_entry) * mid), &index_entry, sizeof(index_entry));
+		if (index_entry.name_hash < name_hash) {
+			low = mid + 1;
 		} else {
-			switch_audio_buffers();
-			current_buffer = next_buffer;
+			high = mid;
 		}
 	}
 
-	uint8_t returned_sample = current_buffer->data[current_buffer->offset];
-	current_buffer->offset++;
-	current_buffer->absolute_offset++;
-	if (current_buffer->absolute_offset == trigger_point) {
-		audio_execute_trigger_point();
+	for (unsigned int i = low; i < entry_count; i++) {
+		spiflash_read(index_offset + (sizeof(index_entry) * i), &index_entry, sizeof(index_entry));
+		if ((index_entry.name_hash != name_hash) || (index_entry.entry_no >= entry_count)) {
+			break;
+		}
+		uint8_t filename[sizeof(((struct audio_toc_entry_t*)0)->filename)];
+		spiflash_read(image_offset + sizeof(struct audio_toc_header_t) + (sizeof(struct audio_toc_entry_t) * index_entry.entry_no) + offsetof(struct audio_toc_entry_t, filename), filename, sizeof(filename));
+		if (!strncmp((const char*)filename, name, sizeof(filename))) {
+			return index_entry.entry_no;
+		}
 	}
-	if (current_buffer->offset >= current_buffer->samples_total) {
-		/* Buffer at end. Switch to next */
-		current_buffer->valid = false;
-		switch_audio_buffers();
+	return -1;
+}
+
+void audio_filter_benchmark(void) {
+	/* Run the cascade on a square wave with the live state set aside */
+	struct audio_filter_state_t saved_state[AUDIO_FILTER_SECTION_COUNT];
+	__disable_irq();
+	memcpy(saved_state, filter.state, sizeof(filter.state));
+	const uint32_t start = SysTick->VAL;
+	for (unsigned int i = 0; i < AUDIO_FILTER_BENCHMARK_SAMPLES; i++) {
+		audio_filter_sample((i & 16) ? 16384 : -16384);
 	}
+	const uint32_t cycles = systick_cycles_since(start);
+	memcpy(filter.state, saved_state, sizeof(filter.state));
+	__enable_irq();
 
-	return returned_sample;
+	printf("Filter: %d sections, %lu cycles per sample (coefficients for %u Hz).\n", AUDIO_FILTER_SECTION_COUNT, cycles / AUDIO_FILTER_BENCHMARK_SAMPLES, filter.coefficients->sample_rate);
+	printf("Budget at %u Hz output: %u cycles per sample.\n", output.sample_rate, 72000000 / output.sample_rate);
+}
+
+int16_t audio_next_sample(void) {
+	if (output.render_clock == sequencer_next_clock) {
+		audio_sequencer_run();
+	}
+
+	/* Mix all voices in Q15 with their Q8 gain and saturate the sum */
+	int32_t mix = 0;
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		struct audio_voice_t *voice = &voices[i];
+		if (voice->synth.tones) {
+			mix += audio_synth_next_sample(voice) * (int32_t)voice->gain;
+		} else if (voice->file.file_length != 0) {
+			mix += audio_voice_next_sample(voice) * (int32_t)voice->gain;
+		}
+	}
+	output.render_clock++;
+	return ssat16(audio_filter_sample(mix / AUDIO_GAIN_UNITY));
 }
 
 void audio_shutoff(void) {
-	/* Disable audio "next_sample" IRQ and set output to 0 */
-	TIM_ITConfig(TIM2, TIM_IT_CC1, DISABLE);
+	/* Stop feeding the PWM and set output to 0 */
+	audio_output_stop();
 	TIM1->CCR1 = 0;
-	audio_file.fileno = -1;
+	__disable_irq();
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		audio_voice_stop(&voices[i]);
+		voices[i].synth.tones = NULL;
+		voices[i].sequence.fileno = -1;
+	}
+	light_queue.fill = 0;
+	live.active = false;
+	memset(filter.state, 0, sizeof(filter.state));
+	if (!dma_voice && !standby.dma_active) {
+		spiflash_stream_close();
+	}
+	__enable_irq();
 }
 
-void audio_init(void) {
-	/* Read audio TOC */
-	for (unsigned int i = 0; i < MAX_FILE_COUNT; i++) {
-		const unsigned int offset = sizeof(struct audio_toc_entry_t) * i;
-		struct audio_toc_entry_t entry;
-		present_files[i].begin_disk_offset = 0xffffffff;
-		for (unsigned int try = 0; try < 100; try++) {
-			spiflash_read(offset, &entry, sizeof(entry));
-			if (entry.begin_disk_offset != 0xffffffff) {
-				uint32_t computed_crc = compute_crc32(&entry, sizeof(entry) - 4);
-				if (computed_crc == entry.crc32) {
-					printf("File %d: \"%s\", offset 0x%lx, length %lu, CRC32 0x%lx OK\n", i, entry.filename, entry.begin_disk_offset, entry.file_length, entry.crc32);
-					present_files[i].begin_disk_offset = entry.begin_disk_offset;
-					present_files[i].file_length = entry.file_length;
-					break;
-				} else {
-					printf("File %d: offset 0x%lx, length %lu, CRC32 ERR 0x%lx computed 0x%lx. Retrying (try #%d).\n", i, entry.begin_disk_offset, entry.file_length, entry.crc32, computed_crc, try + 1);
-					systick_wait();
+static void audio_load_silence_runs(struct audio_file_info_t *file, unsigned int fileno, const struct audio_toc_entry_t *entry) {
+	unsigned int run_count = entry->silence_run_count;
+	file->silence_run_count = 0;
+	if ((run_count == 0) || (run_count == 0xffff)) {
+		return;
+	}
+	if (run_count > AUDIO_MAX_SILENCE_RUNS) {
+		printf("File %d: %u silence runs, only the first %d are used.\n", fileno, run_count, AUDIO_MAX_SILENCE_RUNS);
+		run_count = AUDIO_MAX_SILENCE_RUNS;
+	}
+	if (run_count > AUDIO_SILENCE_POOL_SIZE - silence_run_pool_used) {
+		printf("File %d: %u silence runs, only %u fit into the pool.\n", fileno, run_count, AUDIO_SILENCE_POOL_SIZE - silence_run_pool_used);
+		run_count = AUDIO_SILENCE_POOL_SIZE - silence_run_pool_used;
+	}
+
+	struct audio_silence_run_t *runs = silence_run_pool + silence_run_pool_used;
+	spiflash_read(entry->metadata_offset, runs, sizeof(struct audio_silence_run_t) * run_count);
+
+	/* Runs must be in ascending order and inside the stored data */
+	unsigned int total_samples = 0;
+	for (unsigned int i = 0; i < run_count; i++) {
+		if ((runs[i].data_offset > entry->file_length) || ((i > 0) && (runs[i].data_offset < runs[i - 1].data_offset))) {
+			printf("File %d: silence run %d invalid, ignoring silence table.\n", fileno, i);
+			run_count = 0;
+			break;
+		}
+		total_samples += runs[i].sample_count;
+	}
+	silence_run_pool_used += run_count;
+	file->silence_runs = runs;
+	file->silence_run_count = run_count;
+	if (run_count) {
+		printf("File %d: %u silence runs with %u samples total\n", fileno, run_count, total_samples);
+	}
+}
+
+static void audio_load_cues(struct audio_file_info_t *file, unsigned int fileno, const struct audio_toc_entry_t *entry) {
+	unsigned int cue_count = entry->cue_count;
+	file->cue_count = 0;
+	if ((cue_count == 0) || (cue_count == 0xffff)) {
+		return;
+	}
+	if (cue_count > AUDIO_CUE_POOL_SIZE - cue_pool_used) {
+		printf("File %d: %u cues, only %u fit into the cue pool.\n", fileno, cue_count, AUDIO_CUE_POOL_SIZE - cue_pool_used);
+		cue_count = AUDIO_CUE_POOL_SIZE - cue_pool_used;
+	}
+
+	uint32_t *cues = cue_pool + cue_pool_used;
+	const unsigned int cue_offset = entry->metadata_offset + (sizeof(struct audio_silence_run_t) * entry->silence_run_count);
+	spiflash_read(cue_offset, cues, sizeof(uint32_t) * cue_count);
+	for (unsigned int i = 1; i < cue_count; i++) {
+		if (cues[i] < cues[i - 1]) {
+			printf("File %d: cue %d out of order, ignoring cues.\n", fileno, i);
+			return;
+		}
+	}
+	cue_pool_used += cue_count;
+	file->cues = cues;
+	file->cue_count = cue_count;
+	printf("File %d: %u cues\n", fileno, cue_count);
+}
+
+static void audio_load_payload_crc(struct audio_file_info_t *file, unsigned int fileno, const struct audio_toc_entry_t *entry) {
+	file->payload_crc_verified = false;
+	file->payload_crc_present = (entry->flags & AUDIO_FILE_FLAG_PAYLOAD_CRC) != 0;
+	if (!file->payload_crc_present) {
+		return;
+	}
+
+	const unsigned int payload_crc_offset = entry->metadata_offset + (sizeof(struct audio_silence_run_t) * entry->silence_run_count) + (sizeof(uint32_t) * entry->cue_count);
+	spiflash_read(payload_crc_offset, &file->payload_crc, sizeof(file->payload_crc));
+	printf("File %d: payload CRC 0x%lx\n", fileno, file->payload_crc);
+}
+
+static bool audio_load_entry(struct audio_file_info_t *file, unsigned int fileno, struct audio_toc_entry_t *entry, unsigned int image_offset) {
+	uint32_t computed_crc = compute_crc32(entry, sizeof(*entry) - 4);
+	if (computed_crc != entry->crc32) {
+		printf("File %d: offset 0x%lx, length %lu, CRC32 ERR 0x%lx computed 0x%lx.\n", fileno, entry->begin_disk_offset, entry->file_length, entry->crc32, computed_crc);
+		return false;
+	}
+
+	/* Offsets are relative to the image */
+	entry->begin_disk_offset += image_offset;
+	entry->metadata_offset += image_offset;
+	unsigned int sample_rate = entry->sample_rate;
+	if ((sample_rate < AUDIO_MIN_SAMPLE_RATE) || (sample_rate > AUDIO_MAX_SAMPLE_RATE)) {
+		sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+	}
+	printf("File %d: \"%s\", offset 0x%lx, length %lu, codec %u, %u Hz, CRC32 0x%lx OK\n", fileno, entry->filename, entry->begin_disk_offset, entry->file_length, entry->codec, sample_rate, entry->crc32);
+	file->begin_disk_offset = entry->begin_disk_offset;
+	file->file_length = entry->file_length;
+	file->codec = entry->codec;
+	file->light_track = (entry->flags & AUDIO_FILE_FLAG_LIGHT_TRACK) != 0;
+	file->sample_rate = sample_rate;
+	if (entry->loop_start_offset < entry->file_length) {
+		file->loop_start_offset = entry->loop_start_offset;
+		file->loop_start_position = entry->loop_start_position;
+	} else {
+		file->loop_start_offset = 0;
+		file->loop_start_position = 0;
+	}
+	if (file->loop_start_position) {
+		printf("File %d: intro of %lu samples, loop body starts at offset 0x%lx\n", fileno, entry->loop_start_position, entry->loop_start_offset);
+	}
+	audio_load_silence_runs(file, fileno, entry);
+	audio_load_cues(file, fileno, entry);
+	audio_load_payload_crc(file, fileno, entry);
+	return true;
+}
+
+/* CRC unit over all entries and the index; the loaded entries are in RAM
+ * already, the rest is read in chunks */
+static uint32_t audio_toc_crc(unsigned int image_offset, unsigned int toc_entry_count, uint32_t *loaded_entries, unsigned int loaded_count) {
+	const unsigned int loaded_length = sizeof(struct audio_toc_entry_t) * loaded_count;
+	const unsigned int toc_length = (sizeof(struct audio_toc_entry_t) + sizeof(struct audio_toc_index_entry_t)) * toc_entry_count;
+	uint32_t chunk[32];
+
+	CRC_ResetDR();
+	CRC_CalcBlockCRC(loaded_entries, loaded_length / 4);
+	for (unsigned int offset = loaded_length; offset < toc_length; offset += sizeof(chunk)) {
+		const unsigned int length = ((toc_length - offset) < sizeof(chunk)) ? (toc_length - offset) : sizeof(chunk);
+		spiflash_read(image_offset + sizeof(struct audio_toc_header_t) + offset, chunk, length);
+		CRC_CalcBlockCRC(chunk, length / 4);
+	}
+	return CRC_GetCRC();
+}
+
+/* Returns the number of entries in the TOC */
+static unsigned int audio_load_toc_v2(struct audio_file_info_t *files, unsigned int image_offset, const struct audio_toc_header_t *header) {
+	if (header->version != AUDIO_TOC_VERSION) {
+		printf("TOC version %u unsupported.\n", header->version);
+		return 0;
+	}
+
+	const unsigned int loaded_count = (header->entry_count < MAX_FILE_COUNT) ? header->entry_count : MAX_FILE_COUNT;
+	union {
+		struct audio_toc_entry_t entries[MAX_FILE_COUNT];
+		uint32_t words[MAX_FILE_COUNT * sizeof(struct audio_toc_entry_t) / 4];
+	} toc;
+	for (unsigned int try = 0; try < AUDIO_TOC_MAX_TRIES; try++) {
+		if (spiflash_read(image_offset + sizeof(*header), toc.entries, sizeof(struct audio_toc_entry_t) * loaded_count)) {
+			uint32_t computed_crc = audio_toc_crc(image_offset, header->entry_count, toc.words, loaded_count);
+			if (computed_crc == header->toc_crc32) {
+				printf("TOC v%u: %u entries, CRC 0x%lx OK\n", header->version, header->entry_count, header->toc_crc32);
+				for (unsigned int i = 0; i < loaded_count; i++) {
+					audio_load_entry(&files[i], i, &toc.entries[i], image_offset);
 				}
+				return header->entry_count;
 			}
+			printf("TOC CRC ERR 0x%lx computed 0x%lx. Retrying (try #%d).\n", header->toc_crc32, computed_crc, try + 1);
+		}
+		systick_wait();
+	}
+	return 0;
+}
+
+static void audio_load_bank(unsigned int bank, unsigned int image_offset) {
+	struct audio_file_info_t *files = bank_directory.banks[bank].files;
+	for (unsigned int i = 0; i < MAX_FILE_COUNT; i++) {
+		files[i].begin_disk_offset = 0xffffffff;
+	}
+	bank_directory.banks[bank].image_offset = image_offset;
+	bank_directory.banks[bank].toc_entry_count = 0;
+
+	struct audio_toc_header_t header;
+	for (unsigned int try = 0; try < AUDIO_TOC_MAX_TRIES; try++) {
+		spiflash_read(image_offset, &header, sizeof(header));
+		if ((header.magic == AUDIO_TOC_MAGIC) && (compute_crc32(&header, sizeof(header) - 4) == header.crc32)) {
+			bank_directory.banks[bank].toc_entry_count = audio_load_toc_v2(files, image_offset, &header);
+			return;
+		}
+		printf("TOC header ERR (magic 0x%lx). Retrying (try #%d).\n", header.magic, try + 1);
+		systick_wait();
+	}
+	printf("No valid TOC at 0x%x, images without a versioned TOC have to be recompiled.\n", image_offset);
+}
+
+void audio_init(void) {
+	standby.fileno = -1;
+	cue_pool_used = 0;
+	silence_run_pool_used = 0;
+	memset(&cache, 0, sizeof(cache));
+	audio_filter_select(output.sample_rate);
+	for (unsigned int i = 0; i < AUDIO_VOICE_COUNT; i++) {
+		voices[i].file.fileno = -1;
+		voices[i].sequence.fileno = -1;
+		voices[i].gain = AUDIO_GAIN_UNITY;
+		voices[i].pitch = AUDIO_PITCH_UNITY;
+		voices[i].next_cue_position = AUDIO_NO_CUE;
+	}
+
+	/* Read the bank directory and the TOCs of all banks */
+	bank_directory.count = 0;
+	for (unsigned int i = 0; i < AUDIO_MAX_BANK_COUNT; i++) {
+		struct audio_bank_entry_t entry;
+		spiflash_read(AUDIO_BANK_DIRECTORY_OFFSET + (sizeof(entry) * i), &entry, sizeof(entry));
+		if ((entry.image_offset == 0xffffffff) || (compute_crc32(&entry, sizeof(entry) - 4) != entry.crc32)) {
+			continue;
 		}
+		memcpy(bank_directory.banks[bank_directory.count].name, entry.name, sizeof(entry.name));
+		bank_directory.banks[bank_directory.count].name[sizeof(entry.name) - 1] = 0;
+		printf("Bank %u: \"%s\" at offset 0x%lx\n", bank_directory.count, bank_directory.banks[bank_directory.count].name, entry.image_offset);
+		audio_load_bank(bank_directory.count, entry.image_offset);
+		bank_directory.count++;
+	}
+	if (bank_directory.count == 0) {
+		/* No directory, single image at the start of the flash */
+		strcpy(bank_directory.banks[0].name, "default");
+		audio_load_bank(0, 0);
+		bank_directory.count = 1;
 	}
+	bank_directory.active = 0;
+	present_files = bank_directory.banks[0].files;
 }
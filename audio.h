@@ -24,25 +24,66 @@
 #ifndef __AUDIO_H__
 #define __AUDIO_H__
 
+#include <stdint.h>
 #include <stdbool.h>
 
 enum audio_fileno_t {
 	FILENO_ENGINE_START = 0,
 	FILENO_ENGINE_IDLE = 1,
 	FILENO_ENGINE_STOP = 2,
-	FILENO_SIREN_NO_ENGINE = 3,
-	FILENO_SIREN_WITH_ENGINE = 4,
-	FILENO_TURN_SIGNAL_NO_ENGINE = 5,
-	FILENO_TURN_SIGNAL_WITH_ENGINE = 6,
+	FILENO_SIREN = 3,			/* Unused, the siren is synthesized; keeps file numbers stable */
+	FILENO_TURN_SIGNAL = 4,
+};
+
+/* Bits of the light track state */
+#define AUDIO_LIGHT_SIREN_BLINK		(1 << 0)
+
+/* One step of a synthesizer tone sequence */
+struct audio_synth_tone_t {
+	uint16_t frequency;			/* Q4 Hz */
+	uint16_t duration_ms;
+	uint8_t light_state;		/* Light track state while the tone plays */
+};
+
+enum audio_voice_no_t {
+	VOICE_ENGINE = 0,
+	VOICE_SIREN = 1,
+	VOICE_TURN_SIGNAL = 2,
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void DMA1_Channel5_Handler(void);
 void TIM2_Handler(void);
 void audio_set_volume(unsigned int volume);
+void audio_prefetch(int fileno);
 void audio_playback(unsigned int disk_offset, unsigned int file_length, bool discard_nextbuffer);
+void audio_voice_play(enum audio_voice_no_t voice_no, int fileno);
+void audio_voice_set_gain(enum audio_voice_no_t voice_no, unsigned int gain);
+void audio_voice_set_pitch(enum audio_voice_no_t voice_no, unsigned int pitch);
+int audio_voice_fileno(enum audio_voice_no_t voice_no);
+bool audio_file_has_intro(unsigned int fileno);
 void audio_playback_fileno(unsigned int fileno, bool discard_nextbuffer);
-int audio_current_fileno(void);
-uint8_t audio_next_sample(void);
+unsigned int audio_file_cue_count(unsigned int fileno);
+bool audio_light_poll(uint8_t *light_state);
+bool audio_light_track_active(void);
+void audio_voice_play_synth(enum audio_voice_no_t voice_no, const struct audio_synth_tone_t *tones, unsigned int tone_count);
+void audio_synth_set_pitch(unsigned int pitch);
+void audio_synth_set_tempo(unsigned int tempo);
+void audio_sequence_play(enum audio_voice_no_t voice_no, int fileno, uint32_t clock, unsigned int interval);
+int audio_voice_sequence_fileno(enum audio_voice_no_t voice_no);
+uint32_t audio_output_clock(void);
+unsigned int audio_output_sample_rate(void);
+bool audio_live_start(unsigned int sample_rate, unsigned int codec);
+unsigned int audio_live_write(const uint8_t *data, unsigned int length);
+unsigned int audio_live_credits(void);
+void audio_live_stop(void);
+bool audio_select_bank(unsigned int bank);
+unsigned int audio_bank_count(void);
+unsigned int audio_active_bank(void);
+const char *audio_bank_name(unsigned int bank);
+int audio_file_lookup(const char *name);
+void audio_filter_benchmark(void);
+int16_t audio_next_sample(void);
 void audio_shutoff(void);
 void audio_init(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
@@ -27,6 +27,53 @@ import struct
 import json
 import zlib
 import contextlib
+import enum
+import array
+import math
+from IMAADPCM import IMAADPCM
+
+class Codec(enum.IntEnum):
+	PCM_U8 = 0
+	IMA_ADPCM = 1
+
+class FileFlags(enum.IntFlag):
+	LIGHT_TRACK = (1 << 0)
+	PAYLOAD_CRC = (1 << 1)
+
+# Binary TOC v2: header, entries, then an index of (name hash, entry number)
+# sorted by the hash (zlib CRC-32 of the name). The header CRC is a zlib
+# CRC-32, the CRC over entries and index is computed like the STM32 CRC unit
+# does since the device checks it there. The TOC is padded to whole sectors
+# and followed by one sector of JSON TOC, then the file data. Images without
+# the magic are not supported.
+TOC_MAGIC = b"DTOC"
+TOC_VERSION = 2
+TOC_HEADER_FORMAT = "< 4s H H L L"
+TOC_ENTRY_FORMAT = "< L L B B H 32s L L L H H L"
+TOC_INDEX_FORMAT = "< L H H"
+TOC_SECTOR_SIZE = 4096
+
+def toc_size(entry_count):
+	size = struct.calcsize(TOC_HEADER_FORMAT) + (struct.calcsize(TOC_ENTRY_FORMAT) + struct.calcsize(TOC_INDEX_FORMAT)) * entry_count
+	return (size + TOC_SECTOR_SIZE - 1) // TOC_SECTOR_SIZE * TOC_SECTOR_SIZE
+
+# With a light track, stored data is split into units of this size, each
+# starting with one byte of light state
+LIGHT_UNIT_SIZE = 256
+
+# Payload CRC as computed by the STM32 CRC unit: CRC-32/MPEG-2 (polynomial
+# 0x04c11db7, not reflected, no final XOR) over little endian 32 bit words,
+# the last one zero padded. Each word is shifted in MSB first. This equals the
+# reflected zlib CRC-32 over the bit reversed bytes of the byteswapped words,
+# bit reversed again and without the final XOR.
+_BIT_REVERSED_BYTES = bytes(int("{:08b}".format(i)[::-1], 2) for i in range(256))
+
+def stm32_crc32(data):
+	data = bytes(data) + bytes(-len(data) % 4)
+	word_count = len(data) // 4
+	data = struct.pack("> %dL" % (word_count), *struct.unpack("< %dL" % (word_count), data))
+	crc = zlib.crc32(data.translate(_BIT_REVERSED_BYTES)) ^ 0xffffffff
+	return int("{:032b}".format(crc)[::-1], 2)
 
 class BaseCommand():
 	def __init__(self, cmdname, args):
@@ -39,6 +86,15 @@ class ExtractAudioCommand(BaseCommand):
 		subprocess.check_call([ "ffmpeg", "-i", self._args.input_file, "-vn", "-ar", "44100", "-ac", "2", "-f", "wav", self._args.output_file ])
 
 class CompileAudioImageCommand(BaseCommand):
+	_CODEC_NAMES = {
+		"pcm8":			Codec.PCM_U8,
+		"ima-adpcm":	Codec.IMA_ADPCM,
+	}
+	_MIN_SAMPLE_RATE = 4000
+	_MAX_SAMPLE_RATE = 44100
+	_MAX_SILENCE_RUNS = 8
+	_MAX_FILE_COUNT = 0xffff
+
 	def _hashfile(self, filename):
 		hashval = hashlib.md5()
 		with open(filename, "rb") as f:
@@ -63,8 +119,191 @@ class CompileAudioImageCommand(BaseCommand):
 			toc["entries"].append(entry)
 		return toc
 
-	def _rawify(self, input_filename):
-		return subprocess.check_output([ "sox", input_filename, "-r", "11025", "-e", "unsigned", "-b", "8", "-c", "1", "-t", "raw", "-" ])
+	def _clip_properties(self, input_filename):
+		# Per-clip settings can be overridden by a JSON sidecar file next to
+		# the WAV file, e.g. "siren.json" for "siren.wav"
+		properties = {
+			"codec":		self._args.codec,
+			"sample_rate":	self._args.rate,
+			"silence_threshold":	self._args.silence_threshold,
+			"silence_min_duration":	self._args.silence_min_duration,
+		}
+		sidecar_filename = os.path.splitext(input_filename)[0] + ".json"
+		if os.path.isfile(sidecar_filename):
+			with open(sidecar_filename) as f:
+				properties.update(json.load(f))
+		if not (self._MIN_SAMPLE_RATE <= properties["sample_rate"] <= self._MAX_SAMPLE_RATE):
+			raise ValueError("%s: sample rate %d Hz outside of supported range %d - %d Hz" % (input_filename, properties["sample_rate"], self._MIN_SAMPLE_RATE, self._MAX_SAMPLE_RATE))
+		properties["codec"] = self._CODEC_NAMES[properties["codec"]]
+		return properties
+
+	def _rawify(self, input_filename, sample_rate):
+		return subprocess.check_output([ "sox", input_filename, "-r", str(sample_rate), "-e", "unsigned", "-b", "8", "-c", "1", "-t", "raw", "-" ])
+
+	def _read_samples_s16(self, input_filename, sample_rate):
+		raw_data = subprocess.check_output([ "sox", input_filename, "-r", str(sample_rate), "-e", "signed", "-b", "16", "-L", "-c", "1", "-t", "raw", "-" ])
+		return array.array("h", raw_data)
+
+	def _find_silence_runs(self, levels, properties, granularity, max_runs):
+		"""Returns (start, length) tuples of stretches whose amplitude does not
+		exceed the silence threshold. Audible stretches in between are
+		extended to a multiple of 'granularity' samples so that stored data
+		after a silence run always begins on an ADPCM block boundary."""
+		if properties["silence_threshold"] is None:
+			return [ ]
+		threshold = properties["silence_threshold"] << 8
+		min_length = properties["sample_rate"] * properties["silence_min_duration"] // 1000
+
+		candidates = [ ]
+		run_start = None
+		for (index, level) in enumerate(levels):
+			if abs(level) <= threshold:
+				if run_start is None:
+					run_start = index
+			else:
+				if (run_start is not None) and (index - run_start >= min_length):
+					candidates.append((run_start, index))
+				run_start = None
+		if (run_start is not None) and (len(levels) - run_start >= min_length):
+			candidates.append((run_start, len(levels)))
+
+		# The device only keeps a limited number of runs per file
+		candidates = sorted(sorted(candidates, key = lambda run: run[1] - run[0], reverse = True)[ : max_runs])
+
+		runs = [ ]
+		audible_start = 0
+		for (run_start, run_end) in candidates:
+			audible_length = (run_start - audible_start + granularity - 1) // granularity * granularity
+			run_start = audible_start + audible_length
+			if run_end - run_start < max(min_length, 1):
+				continue
+			runs.append((run_start, run_end - run_start))
+			audible_start = run_end
+
+		if (len(runs) == 1) and (runs[0] == (0, len(levels))):
+			# Completely silent, keep it stored so the file is not empty
+			runs = [ ]
+		return runs
+
+	def _read_wav_cues(self, input_filename):
+		"""Returns the cue points of a WAV file's "cue " chunk in seconds."""
+		sample_rate = None
+		cues = [ ]
+		with open(input_filename, "rb") as f:
+			header = f.read(12)
+			if (len(header) < 12) or (header[0 : 4] != b"RIFF") or (header[8 : 12] != b"WAVE"):
+				return cues
+			while True:
+				chunk_header = f.read(8)
+				if len(chunk_header) < 8:
+					break
+				(chunk_id, chunk_length) = struct.unpack("< 4s L", chunk_header)
+				chunk = f.read(chunk_length + (chunk_length & 1))
+				if chunk_id == b"fmt ":
+					sample_rate = struct.unpack("< L", chunk[4 : 8])[0]
+				elif chunk_id == b"cue ":
+					cue_count = struct.unpack("< L", chunk[ : 4])[0]
+					for i in range(cue_count):
+						(cue_id, position, data_chunk_id, chunk_start, block_start, sample_offset) = struct.unpack("< L L 4s L L L", chunk[4 + 24 * i : 4 + 24 * (i + 1)])
+						cues.append(sample_offset)
+		if sample_rate is None:
+			return [ ]
+		return [ sample_offset / sample_rate for sample_offset in sorted(cues) ]
+
+	def _cue_positions(self, input_filename, properties, loop_start, loop_end, rotation):
+		"""Cue points come from the sidecar's "cues" list (in seconds) or,
+		if there is none, from the WAV file's cue chunk. They are returned as
+		playback positions in samples."""
+		if "cues" in properties:
+			cues = properties["cues"]
+		else:
+			cues = self._read_wav_cues(input_filename)
+		cues = sorted(round(cue * properties["sample_rate"]) for cue in cues)
+
+		# Cues which the rotated loop body moved to the intro also have to
+		# fire on every later pass of the loop
+		loop_length = loop_end - loop_start
+		positions = [ cue for cue in cues if cue < loop_end ]
+		positions += [ cue + loop_length for cue in cues if loop_start <= cue < loop_start + rotation ]
+		return sorted(positions)
+
+	def _light_state(self, properties, sample_index):
+		"""The sidecar's "lights" list holds [ time in seconds, light byte ]
+		change points; the state holds until the next change."""
+		state = 0
+		for (time, value) in properties["lights"]:
+			if round(time * properties["sample_rate"]) > sample_index:
+				break
+			state = value
+		return state
+
+	def _encode_segment(self, samples, indices, codec, properties):
+		(encode_segment, samples_per_unit) = codec
+		payload = encode_segment([ samples[i] for i in indices ])
+		if "lights" not in properties:
+			return payload
+
+		# Every unit starts with the light state at its first sample
+		encoded = bytearray()
+		for (unit_no, payload_start) in enumerate(range(0, len(payload), LIGHT_UNIT_SIZE - 1)):
+			encoded.append(self._light_state(properties, indices[unit_no * samples_per_unit]))
+			encoded += payload[payload_start : payload_start + LIGHT_UNIT_SIZE - 1]
+		return encoded
+
+	def _encode_segments(self, samples, indices, silence_runs, codec, properties, data, data_silence_runs):
+		segment_start = 0
+		for (run_start, run_length) in silence_runs:
+			data += self._encode_segment(samples, indices[segment_start : run_start], codec, properties)
+			data_silence_runs.append((len(data), run_length))
+			segment_start = run_start + run_length
+		data += self._encode_segment(samples, indices[segment_start : ], codec, properties)
+
+	def _encode(self, input_filename, properties):
+		"""Returns the stored data with all silence runs removed, a list of
+		(data offset, sample count) tuples describing where the device has
+		to insert them again, the (data offset, sample position) at which
+		the loop body starts and the cue positions."""
+		sample_rate = properties["sample_rate"]
+		payload_unit_size = (LIGHT_UNIT_SIZE - 1) if ("lights" in properties) else None
+		if properties["codec"] == Codec.IMA_ADPCM:
+			samples = list(self._read_samples_s16(input_filename, sample_rate))
+			levels = samples
+			block_size = payload_unit_size or IMAADPCM.BLOCK_SIZE
+			codec = (lambda segment: IMAADPCM.encode(segment, block_size = block_size), IMAADPCM.samples_per_block(block_size))
+			granularity = codec[1]
+		else:
+			samples = list(self._rawify(input_filename, sample_rate))
+			levels = [ (value - 128) << 8 for value in samples ]
+			codec = (bytes, payload_unit_size)
+			granularity = payload_unit_size or 1
+
+		# Everything after the loop end is never played
+		loop_start = round(properties.get("loop_start", 0) * sample_rate)
+		loop_end = round(properties["loop_end"] * sample_rate) if ("loop_end" in properties) else len(samples)
+		if not (0 <= loop_start < loop_end <= len(samples)):
+			raise ValueError("%s: loop region %d - %d invalid for %d samples" % (input_filename, loop_start, loop_end, len(samples)))
+		loop_length = loop_end - loop_start
+
+		intro_runs = self._find_silence_runs(levels[ : loop_start], properties, granularity, self._MAX_SILENCE_RUNS)
+
+		# The loop body has to start on an ADPCM block (or light unit)
+		# boundary. Complete the last block of the intro with the beginning of
+		# the loop body and rotate the body by the same amount; what is played
+		# stays identical.
+		last_intro_segment_start = (intro_runs[-1][0] + intro_runs[-1][1]) if (len(intro_runs) > 0) else 0
+		rotation = -(loop_start - last_intro_segment_start) % granularity
+		body_indices = [ loop_start + ((rotation + i) % loop_length) for i in range(loop_length) ]
+		intro_indices = list(range(loop_start)) + [ loop_start + (i % loop_length) for i in range(rotation) ]
+		body_levels = [ levels[i] for i in body_indices ]
+		body_runs = self._find_silence_runs(body_levels, properties, granularity, self._MAX_SILENCE_RUNS - len(intro_runs))
+
+		data = bytearray()
+		silence_runs = [ ]
+		self._encode_segments(samples, intro_indices, intro_runs, codec, properties, data, silence_runs)
+		loop_start_offset = len(data)
+		self._encode_segments(samples, body_indices, body_runs, codec, properties, data, silence_runs)
+		cues = self._cue_positions(input_filename, properties, loop_start, loop_end, rotation)
+		return (data, silence_runs, (loop_start_offset, len(intro_indices)), cues)
 
 	def _pad_to(self, data, length):
 		assert(len(data) <= length)
@@ -77,8 +316,21 @@ class CompileAudioImageCommand(BaseCommand):
 		content = [ ]
 		offset = base_offset
 		for filename in self._file_names:
-			data = self._rawify(filename)
+			properties = self._clip_properties(filename)
+			(data, silence_runs, (loop_start_offset, loop_start_position), cues) = self._encode(filename, properties)
 			size = len(data)
+
+			# Metadata (silence runs, cue positions, then the payload CRC)
+			# directly follows the data, 4-byte aligned
+			payload_crc = stm32_crc32(data)
+			data = self._pad_to(data, (size + 3) // 4 * 4)
+			metadata_offset = offset + len(data)
+			for (data_offset, sample_count) in silence_runs:
+				data += struct.pack("< L L", data_offset, sample_count)
+			for cue in cues:
+				data += struct.pack("< L", cue)
+			data += struct.pack("< L", payload_crc)
+
 			padded_data_size = (len(data) + alignment - 1) // alignment * alignment
 			data = self._pad_to(data, padded_data_size)
 			entry = {
@@ -86,7 +338,20 @@ class CompileAudioImageCommand(BaseCommand):
 				"name":		os.path.splitext(os.path.basename(filename))[0],
 				"data":		data,
 				"size":		size,
+				"codec":	properties["codec"],
+				"flags":	FileFlags.PAYLOAD_CRC | (FileFlags.LIGHT_TRACK if ("lights" in properties) else 0),
+				"rate":		properties["sample_rate"],
+				"loop_start_offset":	loop_start_offset,
+				"loop_start_position":	loop_start_position,
+				"metadata_offset":		metadata_offset,
+				"silence_run_count":	len(silence_runs),
+				"cue_count":			len(cues),
 			}
+			if len(entry["name"].encode()) >= 32:
+				raise ValueError("%s: name too long for the TOC, must be at most 31 bytes" % (entry["name"]))
+			if len(silence_runs) > 0:
+				elided_samples = sum(sample_count for (data_offset, sample_count) in silence_runs)
+				print("%s: %d silence runs with %d samples elided" % (entry["name"], len(silence_runs), elided_samples))
 			content.append(entry)
 			offset += padded_data_size
 		return content
@@ -94,18 +359,22 @@ class CompileAudioImageCommand(BaseCommand):
 	def _generate_image(self):
 		image = bytearray()
 
-		# Binary TOC first
+		# Binary TOC first: entries, then the index sorted by name hash
 		binary_toc = bytearray()
 		for entry in self._content:
-			binary_entry_without_crc = struct.pack("< L L 52s", entry["offset"], entry["size"], entry["name"].encode())
+			binary_entry_without_crc = struct.pack("< L L B B H 32s L L L H H", entry["offset"], entry["size"], entry["codec"], entry["flags"], entry["rate"], entry["name"].encode(), entry["loop_start_offset"], entry["loop_start_position"], entry["metadata_offset"], entry["silence_run_count"], entry["cue_count"])
 			crc = zlib.crc32(binary_entry_without_crc)
 			binary_entry = struct.pack("< 60s L", binary_entry_without_crc, crc)
 			binary_toc += binary_entry
-		binary_toc = self._pad_to(binary_toc, 4096)
-		image += binary_toc
+		index = sorted((zlib.crc32(entry["name"].encode()), entry_no) for (entry_no, entry) in enumerate(self._content))
+		for (name_hash, entry_no) in index:
+			binary_toc += struct.pack(TOC_INDEX_FORMAT, name_hash, entry_no, 0xffff)
+		header_without_crc = struct.pack("< 4s H H L", TOC_MAGIC, TOC_VERSION, len(self._content), stm32_crc32(binary_toc))
+		binary_toc = header_without_crc + struct.pack("< L", zlib.crc32(header_without_crc)) + binary_toc
+		image += self._pad_to(binary_toc, toc_size(len(self._content)))
 
 		# JSON TOC then
-		json_toc = self._pad_to(json.dumps(self._toc, sort_keys = True).encode("ascii"), 4096)
+		json_toc = self._pad_to(json.dumps(self._toc, sort_keys = True).encode("ascii"), TOC_SECTOR_SIZE)
 		image += json_toc
 
 		for entry in self._content:
@@ -115,33 +384,208 @@ class CompileAudioImageCommand(BaseCommand):
 
 	def run(self):
 		self._file_names = sorted(glob.glob(self._args.input_dir + "/*.wav"))
+		if len(self._file_names) > self._MAX_FILE_COUNT:
+			raise Exception("At most %d files fit into the TOC, %d given." % (self._MAX_FILE_COUNT, len(self._file_names)))
 		self._toc = self._generate_toc()
-		self._content = self._generate_content(base_offset = 8192, alignment = 4096)
+		self._content = self._generate_content(base_offset = toc_size(len(self._file_names)) + TOC_SECTOR_SIZE, alignment = TOC_SECTOR_SIZE)
 		self._image = self._generate_image()
 		with open(self._args.output_file, "wb") as f:
 			f.write(self._image)
 
 class DecompileAudioImageCommand(BaseCommand):
+	def _read_toc(self):
+		# Returns the offsets of all TOC entries and the size of the binary TOC
+		header_size = struct.calcsize(TOC_HEADER_FORMAT)
+		entry_size = struct.calcsize(TOC_ENTRY_FORMAT)
+		(magic, version, entry_count, entries_crc, header_crc) = struct.unpack(TOC_HEADER_FORMAT, self._image[: header_size])
+		if magic != TOC_MAGIC:
+			raise Exception("No TOC magic, the image has to be recompiled.")
+
+		if version != TOC_VERSION:
+			raise Exception("Unsupported TOC version %d." % (version))
+		computed_header_crc = zlib.crc32(self._image[: header_size - 4])
+		index_offset = header_size + entry_size * entry_count
+		index_end = index_offset + struct.calcsize(TOC_INDEX_FORMAT) * entry_count
+		computed_entries_crc = stm32_crc32(self._image[header_size : index_end])
+		print("TOC v%d: %d entries, header CRC 0x%x %s, TOC CRC 0x%x %s" % (version, entry_count, header_crc, "OK" if (header_crc == computed_header_crc) else "ERR", entries_crc, "OK" if (entries_crc == computed_entries_crc) else "ERR"))
+		index = [ struct.unpack(TOC_INDEX_FORMAT, self._image[offset : offset + struct.calcsize(TOC_INDEX_FORMAT)])[: 2] for offset in range(index_offset, index_end, struct.calcsize(TOC_INDEX_FORMAT)) ]
+		if index != sorted(index):
+			print("Index is not sorted by name hash.")
+		return ([ header_size + entry_size * entry_no for entry_no in range(entry_count) ], toc_size(entry_count))
+
 	def run(self):
 		with open(self._args.input_file, "rb") as f:
 			self._image = f.read()
 		with contextlib.suppress(FileExistsError):
 			os.makedirs(self._args.output_dir)
 
-		for entry_no in range(64):
-			data = self._image[64 * entry_no : 64 * (entry_no + 1)]
-			(offset, size, name, crc) = struct.unpack("< L L 52s L", data)
+		(entry_offsets, binary_toc_size) = self._read_toc()
+		for entry_offset in entry_offsets:
+			data = self._image[entry_offset : entry_offset + struct.calcsize(TOC_ENTRY_FORMAT)]
+			(offset, size, codec, flags, rate, name, loop_start_offset, loop_start_position, metadata_offset, silence_run_count, cue_count, crc) = struct.unpack(TOC_ENTRY_FORMAT, data)
 			if offset != 0xffffffff:
+				codec = Codec(codec)
+				flags = FileFlags(flags)
 				name = name.rstrip(b"\x00").decode()
-				print("%s: offset 0x%x size %d, CRC 0x%x" % (name, offset, size, crc))
+				print("%s: offset 0x%x size %d, codec %s, %d Hz, loop from sample %d (offset 0x%x), %d silence runs, %d cues, CRC 0x%x" % (name, offset, size, codec.name, rate, loop_start_position, loop_start_offset, silence_run_count, cue_count, crc))
 				output_filename = self._args.output_dir + "/" + name + ".raw"
+				silence_runs = [ struct.unpack("< L L", self._image[metadata_offset + 8 * i : metadata_offset + 8 * (i + 1)]) for i in range(silence_run_count) ]
+				cue_offset = metadata_offset + 8 * silence_run_count
+				cues = [ struct.unpack("< L", self._image[cue_offset + 4 * i : cue_offset + 4 * (i + 1)])[0] for i in range(cue_count) ]
+				if len(cues) > 0:
+					print("    Cues at samples: %s" % (", ".join(str(cue) for cue in cues)))
+				if flags & FileFlags.PAYLOAD_CRC:
+					payload_crc_offset = cue_offset + 4 * cue_count
+					payload_crc = struct.unpack("< L", self._image[payload_crc_offset : payload_crc_offset + 4])[0]
+					computed_payload_crc = stm32_crc32(self._image[offset : offset + size])
+					print("    Payload CRC 0x%x %s" % (payload_crc, "OK" if (payload_crc == computed_payload_crc) else ("ERR, computed 0x%x" % (computed_payload_crc))))
+				block_size = (LIGHT_UNIT_SIZE - 1) if (flags & FileFlags.LIGHT_TRACK) else IMAADPCM.BLOCK_SIZE
+				if codec == Codec.IMA_ADPCM:
+					decode_segment = lambda segment: array.array("h", IMAADPCM.decode(segment, block_size = block_size)).tobytes()
+					silence = array.array("h", [ 0 ]).tobytes()
+					sox_format = [ "-e", "signed", "-b", "16", "-L" ]
+				else:
+					decode_segment = bytes
+					silence = bytes([ 128 ])
+					sox_format = [ "-e", "unsigned", "-b", "8" ]
+
+				# Strip the light track and re-insert the elided silence runs
+				light_states = [ ]
+				def strip_light_track(segment):
+					if not (flags & FileFlags.LIGHT_TRACK):
+						return segment
+					payload = bytearray()
+					for unit_start in range(0, len(segment), LIGHT_UNIT_SIZE):
+						light_states.append(segment[unit_start])
+						payload += segment[unit_start + 1 : unit_start + LIGHT_UNIT_SIZE]
+					return payload
+
+				data = bytearray()
+				segment_start = 0
+				for (data_offset, sample_count) in silence_runs:
+					data += decode_segment(strip_light_track(self._image[offset + segment_start : offset + data_offset]))
+					data += silence * sample_count
+					segment_start = data_offset
+				data += decode_segment(strip_light_track(self._image[offset + segment_start : offset + size]))
+				if len(light_states) > 0:
+					print("    Light track: %s" % (" ".join("%02x" % (state) for state in light_states)))
 				with open(output_filename, "wb") as f:
-					f.write(self._image[offset : offset + size])
+					f.write(data)
 
 				output_filename_wav = self._args.output_dir + "/" + name + ".wav"
-				subprocess.check_output([ "sox", "-r", "11025", "-e", "unsigned", "-b", "8", "-c", "1", "-t", "raw", output_filename, output_filename_wav ])
+				subprocess.check_output([ "sox", "-r", str(rate) ] + sox_format + [ "-c", "1", "-t", "raw", output_filename, output_filename_wav ])
 
-		json_toc = self._image[4096 : 8192].rstrip(b"\xff")
+		json_toc = self._image[binary_toc_size : binary_toc_size + TOC_SECTOR_SIZE].rstrip(b"\xff")
 		json_toc = json.loads(json_toc)
 		with open(self._args.output_dir + "/toc.json", "w") as f:
 			json.dump(json_toc, f, indent = 4, sort_keys = True)
+
+class BankDirectoryCommand(BaseCommand):
+	_SECTOR_SIZE = 4096
+	_MAX_BANK_COUNT = 4
+
+	def run(self):
+		if len(self._args.bank) > self._MAX_BANK_COUNT:
+			raise Exception("At most %d banks are supported, %d given." % (self._MAX_BANK_COUNT, len(self._args.bank)))
+
+		directory = bytearray()
+		for bank in self._args.bank:
+			(name, offset) = bank.split("=", maxsplit = 1)
+			offset = int(offset, 0)
+			if (offset % self._SECTOR_SIZE) != 0:
+				raise Exception("Bank %s: offset 0x%x is not sector aligned." % (name, offset))
+			name = name.encode("utf-8")
+			if len(name) >= 24:
+				raise Exception("Bank name too long: %s" % (name))
+			entry = struct.pack("< L 24s", offset, name)
+			directory += entry + struct.pack("< L", zlib.crc32(entry))
+		directory += bytes([ 0xff ]) * (self._SECTOR_SIZE - len(directory))
+		with open(self._args.output_file, "wb") as f:
+			f.write(directory)
+
+class GenerateFilterCommand(BaseCommand):
+	_COEFFICIENT_BITS = 29
+
+	def _design_section(self, section, sample_rate):
+		if "relative_frequency" in section:
+			frequency = section["relative_frequency"] * sample_rate
+		else:
+			frequency = section["frequency"]
+		if frequency >= 0.49 * sample_rate:
+			# Cannot be realized at this rate, pass through
+			return (1, 0, 0, 1, 0, 0)
+
+		w0 = 2 * math.pi * frequency / sample_rate
+		cos_w0 = math.cos(w0)
+		alpha = math.sin(w0) / (2 * section.get("q", 1 / math.sqrt(2)))
+		a = 10 ** (section.get("gain", 0) / 40)
+		sqrt_a_alpha = 2 * math.sqrt(a) * alpha
+
+		# Audio EQ cookbook, R. Bristow-Johnson
+		if section["type"] == "lowpass":
+			return ((1 - cos_w0) / 2, 1 - cos_w0, (1 - cos_w0) / 2, 1 + alpha, -2 * cos_w0, 1 - alpha)
+		elif section["type"] == "highpass":
+			return ((1 + cos_w0) / 2, -(1 + cos_w0), (1 + cos_w0) / 2, 1 + alpha, -2 * cos_w0, 1 - alpha)
+		elif section["type"] == "peaking":
+			return (1 + alpha * a, -2 * cos_w0, 1 - alpha * a, 1 + alpha / a, -2 * cos_w0, 1 - alpha / a)
+		elif section["type"] == "lowshelf":
+			return (
+				a * ((a + 1) - (a - 1) * cos_w0 + sqrt_a_alpha),
+				2 * a * ((a - 1) - (a + 1) * cos_w0),
+				a * ((a + 1) - (a - 1) * cos_w0 - sqrt_a_alpha),
+				(a + 1) + (a - 1) * cos_w0 + sqrt_a_alpha,
+				-2 * ((a - 1) + (a + 1) * cos_w0),
+				(a + 1) + (a - 1) * cos_w0 - sqrt_a_alpha,
+			)
+		elif section["type"] == "highshelf":
+			return (
+				a * ((a + 1) + (a - 1) * cos_w0 + sqrt_a_alpha),
+				-2 * a * ((a - 1) + (a + 1) * cos_w0),
+				a * ((a + 1) + (a - 1) * cos_w0 - sqrt_a_alpha),
+				(a + 1) - (a - 1) * cos_w0 + sqrt_a_alpha,
+				2 * ((a - 1) - (a + 1) * cos_w0),
+				(a + 1) - (a - 1) * cos_w0 - sqrt_a_alpha,
+			)
+		else:
+			raise Exception("Unknown filter section type: %s" % (section["type"]))
+
+	def _quantize(self, value):
+		quantized = round(value * (1 << self._COEFFICIENT_BITS))
+		if not (-(2 ** 31) <= quantized < (2 ** 31)):
+			raise Exception("Filter coefficient %f out of range." % (value))
+		return quantized
+
+	def _coefficients(self, spec, sample_rate):
+		sections = [ ]
+		gain = 10 ** (spec.get("pregain", 0) / 20)
+		for section in spec["sections"]:
+			(b0, b1, b2, a0, a1, a2) = self._design_section(section, sample_rate)
+			# The pre-gain is folded into the first section. Feedback
+			# coefficients are stored negated so the filter only adds.
+			sections.append([ self._quantize(gain * b0 / a0), self._quantize(gain * b1 / a0), self._quantize(gain * b2 / a0), self._quantize(-a1 / a0), self._quantize(-a2 / a0) ])
+			gain = 1
+		return sections
+
+	def run(self):
+		with open(self._args.spec_file) as f:
+			spec = json.load(f)
+
+		lines = [ ]
+		lines.append("/* Generated by 'audiotool filter' from %s, do not edit. Coefficients are" % (os.path.basename(self._args.spec_file)))
+		lines.append(" * Q%d { b0, b1, b2, -a1, -a2 } per section, one set per sample rate. */" % (self._COEFFICIENT_BITS))
+		lines.append("#ifndef __AUDIO_FILTER_H__")
+		lines.append("#define __AUDIO_FILTER_H__")
+		lines.append("")
+		lines.append("#define AUDIO_FILTER_COEFFICIENT_BITS\t%d" % (self._COEFFICIENT_BITS))
+		lines.append("#define AUDIO_FILTER_SECTION_COUNT\t\t%d" % (len(spec["sections"])))
+		lines.append("#define AUDIO_FILTER_RATE_COUNT\t\t\t%d" % (len(spec["sample_rates"])))
+		lines.append("#define AUDIO_FILTER_COEFFICIENTS\t\t{ \\")
+		for sample_rate in sorted(spec["sample_rates"]):
+			sections = self._coefficients(spec, sample_rate)
+			section_text = ", ".join("{ %s }" % (", ".join(str(coefficient) for coefficient in section)) for section in sections)
+			lines.append("\t{ .sample_rate = %d, .sections = { %s } }, \\" % (sample_rate, section_text))
+		lines.append("}")
+		lines.append("")
+		lines.append("#endif")
+		with open(self._args.output_file, "w") as f:
+			f.write("\n".join(lines) + "\n")
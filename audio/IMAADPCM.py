@@ -0,0 +1,139 @@
+#	defiant - Modded Bobby Car toy for toddlers
+#	Copyright (C) 2020-2020 Johannes Bauer
+#
+#	This file is part of defiant.
+#
+#	defiant is free software; you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation; this program is ONLY licensed under
+#	version 3 of the License, later versions are explicitly excluded.
+#
+#	defiant is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with defiant; if not, write to the Free Software
+#	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+#	Johannes Bauer <JohannesBauer@gmx.de>
+
+import struct
+
+class IMAADPCM():
+	"""4-bit IMA-ADPCM in self-contained blocks. Every block starts with a
+	4-byte header (initial predictor as signed 16 bit little endian, step
+	index, flags) followed by the nibbles, low nibble first. The decoder in
+	audio.c mirrors _decode_nibble() exactly."""
+	BLOCK_SIZE = 256
+	HEADER_SIZE = 4
+	SAMPLES_PER_BLOCK = (BLOCK_SIZE - HEADER_SIZE) * 2
+	FLAG_PADDING_NIBBLE = (1 << 0)		# High nibble of the block's last byte is not a sample
+
+	_INDEX_TABLE = [ -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 ]
+	_STEP_TABLE = [
+		7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+		50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+		253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+		1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+		3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+		11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+		32767,
+	]
+
+	@classmethod
+	def _clamp(cls, value, minval, maxval):
+		return min(max(value, minval), maxval)
+
+	@classmethod
+	def _decode_nibble(cls, predictor, step_index, nibble):
+		step = cls._STEP_TABLE[step_index]
+		diff = step >> 3
+		if nibble & 4:
+			diff += step
+		if nibble & 2:
+			diff += step >> 1
+		if nibble & 1:
+			diff += step >> 2
+		if nibble & 8:
+			predictor -= diff
+		else:
+			predictor += diff
+		predictor = cls._clamp(predictor, -32768, 32767)
+		step_index = cls._clamp(step_index + cls._INDEX_TABLE[nibble], 0, 88)
+		return (predictor, step_index)
+
+	@classmethod
+	def _encode_sample(cls, predictor, step_index, sample):
+		step = cls._STEP_TABLE[step_index]
+		diff = sample - predictor
+		nibble = 0
+		if diff < 0:
+			nibble = 8
+			diff = -diff
+		if diff >= step:
+			nibble |= 4
+			diff -= step
+		if diff >= step >> 1:
+			nibble |= 2
+			diff -= step >> 1
+		if diff >= step >> 2:
+			nibble |= 1
+
+		# Track the decoder state exactly so quantization errors do not add up
+		(predictor, step_index) = cls._decode_nibble(predictor, step_index, nibble)
+		return (nibble, predictor, step_index)
+
+	@classmethod
+	def samples_per_block(cls, block_size = BLOCK_SIZE):
+		return (block_size - cls.HEADER_SIZE) * 2
+
+	@classmethod
+	def encode(cls, samples, block_size = BLOCK_SIZE):
+		"""Encodes a sequence of signed 16 bit samples. The last block is
+		truncated so that no padding samples are played back."""
+		encoded = bytearray()
+		step_index = 0
+		samples_per_block = cls.samples_per_block(block_size)
+		for block_start in range(0, len(samples), samples_per_block):
+			block_samples = samples[block_start : block_start + samples_per_block]
+			predictor = block_samples[0]
+			flags = cls.FLAG_PADDING_NIBBLE if ((len(block_samples) % 2) == 1) else 0
+			encoded += struct.pack("< h B B", predictor, step_index, flags)
+
+			nibbles = [ ]
+			for sample in block_samples:
+				(nibble, predictor, step_index) = cls._encode_sample(predictor, step_index, sample)
+				nibbles.append(nibble)
+			if (len(nibbles) % 2) == 1:
+				nibbles.append(0)
+			for i in range(0, len(nibbles), 2):
+				encoded.append(nibbles[i] | (nibbles[i + 1] << 4))
+		return encoded
+
+	@classmethod
+	def decode(cls, data, block_size = BLOCK_SIZE):
+		samples = [ ]
+		for block_start in range(0, len(data), block_size):
+			block = data[block_start : block_start + block_size]
+			(predictor, step_index, flags) = struct.unpack("< h B B", block[: cls.HEADER_SIZE])
+			step_index = cls._clamp(step_index, 0, 88)
+			nibbles = [ ]
+			for byte in block[cls.HEADER_SIZE : ]:
+				nibbles += [ byte & 0xf, byte >> 4 ]
+			if flags & cls.FLAG_PADDING_NIBBLE:
+				nibbles.pop()
+			for nibble in nibbles:
+				(predictor, step_index) = cls._decode_nibble(predictor, step_index, nibble)
+				samples.append(predictor)
+		return samples
+
+if __name__ == "__main__":
+	import math
+	samples = [ round(12000 * math.sin(2 * math.pi * 440 * t / 11025)) for t in range(5001) ]
+	decoded = IMAADPCM.decode(IMAADPCM.encode(samples))
+	assert(len(decoded) == len(samples))
+	assert(len(IMAADPCM.decode(IMAADPCM.encode(samples, block_size = 255), block_size = 255)) == len(samples))
+	max_error = max(abs(x - y) for (x, y) in zip(samples[50:], decoded[50:]))
+	print("%d samples, %d decoded, max error %d after step size adapted" % (len(samples), len(decoded), max_error))
@@ -53,6 +53,11 @@ bool debounce_button_active(struct debounce_t *button, unsigned int current_stat
 	return debounce_button(button, current_state) && button->last_state;
 }
 
+bool debounce_button_pending(const struct debounce_t *button) {
+	/* Input differs from the debounced state but has not fired yet */
+	return (button->counter != 0) && (button->counter < button->config->fire_threshold);
+}
+
 #ifdef __MAIN__
 // gcc -D__MAIN__ -fsanitize=address -fsanitize=leak -fsanitize=undefined -std=c11 -O2 -o debounce debounce.c && ./debounce
 #include <stdio.h>
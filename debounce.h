@@ -40,6 +40,7 @@ struct debounce_t {
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool debounce_button(struct debounce_t *button, unsigned int current_state);
 bool debounce_button_active(struct debounce_t *button, unsigned int current_state);
+bool debounce_button_pending(const struct debounce_t *button);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
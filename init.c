@@ -71,7 +71,7 @@ static void init_spi(void) {
 	SPI_I2S_ITConfig(SPI1, SPI_I2S_IT_ERR, ENABLE);
 }
 
-void init_spi_dma(void *vdata, unsigned int length) {
+static void init_spi_dma(void) {
 	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
 
 	DMA_Channel_TypeDef *dma_channel_rx = DMA1_Channel2;
@@ -79,9 +79,9 @@ void init_spi_dma(void *vdata, unsigned int length) {
 
 	DMA_Init(dma_channel_rx, &(DMA_InitTypeDef){
 		.DMA_PeripheralBaseAddr = (uint32_t)(&SPI1->DR),
-		.DMA_MemoryBaseAddr = (uint32_t)(vdata),
+		.DMA_MemoryBaseAddr = 0,
 		.DMA_DIR = DMA_DIR_PeripheralSRC,
-		.DMA_BufferSize = length,
+		.DMA_BufferSize = 0,
 		.DMA_PeripheralInc = DMA_PeripheralInc_Disable,
 		.DMA_MemoryInc = DMA_MemoryInc_Enable,
 		.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte,
@@ -93,9 +93,9 @@ void init_spi_dma(void *vdata, unsigned int length) {
 
 	DMA_Init(dma_channel_tx, &(DMA_InitTypeDef){
 		.DMA_PeripheralBaseAddr = (uint32_t)(&SPI1->DR),
-		.DMA_MemoryBaseAddr = (uint32_t)(vdata),
+		.DMA_MemoryBaseAddr = 0,
 		.DMA_DIR = DMA_DIR_PeripheralDST,
-		.DMA_BufferSize = length,
+		.DMA_BufferSize = 0,
 		.DMA_PeripheralInc = DMA_PeripheralInc_Disable,
 		.DMA_MemoryInc = DMA_MemoryInc_Enable,
 		.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte,
@@ -109,6 +109,46 @@ void init_spi_dma(void *vdata, unsigned int length) {
 	DMA_ITConfig(DMA1_Channel3, DMA_IT_TC, ENABLE);
 }
 
+static void init_audio_dma(void) {
+	/* TIM2 CC1 requests are routed to DMA1 channel 5, which feeds the PWM
+	 * duty cycle from a circular buffer. Memory address and length are set
+	 * by the audio code when playback starts. */
+	DMA_Init(DMA1_Channel5, &(DMA_InitTypeDef){
+		.DMA_PeripheralBaseAddr = (uint32_t)(&TIM1->CCR1),
+		.DMA_MemoryBaseAddr = 0,
+		.DMA_DIR = DMA_DIR_PeripheralDST,
+		.DMA_BufferSize = 0,
+		.DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+		.DMA_MemoryInc = DMA_MemoryInc_Enable,
+		.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord,
+		.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord,
+		.DMA_Mode = DMA_Mode_Circular,
+		.DMA_Priority = DMA_Priority_High,
+		.DMA_M2M = DMA_M2M_Disable,
+	});
+
+	DMA_ITConfig(DMA1_Channel5, DMA_IT_HT | DMA_IT_TC, ENABLE);
+}
+
+static void init_crc_dma(void) {
+	/* Memory to memory transfer of received audio blocks into the CRC unit;
+	 * lowest priority so that it only takes otherwise idle bus cycles.
+	 * Addresses and length are set by the audio code for each block. */
+	DMA_Init(DMA1_Channel1, &(DMA_InitTypeDef){
+		.DMA_PeripheralBaseAddr = (uint32_t)(&CRC->DR),
+		.DMA_MemoryBaseAddr = 0,
+		.DMA_DIR = DMA_DIR_PeripheralDST,
+		.DMA_BufferSize = 0,
+		.DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+		.DMA_MemoryInc = DMA_MemoryInc_Enable,
+		.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word,
+		.DMA_MemoryDataSize = DMA_MemoryDataSize_Word,
+		.DMA_Mode = DMA_Mode_Normal,
+		.DMA_Priority = DMA_Priority_Low,
+		.DMA_M2M = DMA_M2M_Enable,
+	});
+}
+
 static void init_nvic(void) {
 	NVIC_PriorityGroupConfig(NVIC_PriorityGroup_2);
 
@@ -144,6 +184,14 @@ static void init_nvic(void) {
 		.NVIC_IRQChannelCmd = ENABLE,
 	});
 
+	/* DMA1 TIM2 CC1 -> TIM1 CCR1 (audio output half/full transfer) */
+	NVIC_Init(&(NVIC_InitTypeDef){
+		.NVIC_IRQChannel = DMA1_Channel5_IRQn,
+		.NVIC_IRQChannelPreemptionPriority = 3,
+		.NVIC_IRQChannelSubPriority = 0,
+		.NVIC_IRQChannelCmd = ENABLE,
+	});
+
 	/* Update PWM Timer */
 	NVIC_Init(&(NVIC_InitTypeDef){
 		.NVIC_IRQChannel = TIM2_IRQn,
@@ -151,12 +199,20 @@ static void init_nvic(void) {
 		.NVIC_IRQChannelSubPriority = 0,
 		.NVIC_IRQChannelCmd = ENABLE,
 	});
+
+	/* SPI flash BUSY poll */
+	NVIC_Init(&(NVIC_InitTypeDef){
+		.NVIC_IRQChannel = TIM3_IRQn,
+		.NVIC_IRQChannelPreemptionPriority = 3,
+		.NVIC_IRQChannelSubPriority = 3,
+		.NVIC_IRQChannelCmd = ENABLE,
+	});
 }
 
 static void init_pwm(void) {
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
 	TIM_TimeBaseInit(TIM1, &(TIM_TimeBaseInitTypeDef){
-		.TIM_Period = 254,
+		.TIM_Period = 1023,			// 10 bit PWM at 70.3 kHz, see AUDIO_PWM_BITS in audio.c
 		.TIM_Prescaler = 0,
 		.TIM_ClockDivision = 0,
 		.TIM_CounterMode = TIM_CounterMode_Up,
@@ -176,16 +232,31 @@ static void init_pwm(void) {
 static void init_pwm_update_timer(void) {
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
 	TIM_TimeBaseInit(TIM2, &(TIM_TimeBaseInitTypeDef){
-		.TIM_Period = 1306,			// 11025 Hz
+		.TIM_Period = 1306,			// 11025 Hz, reprogrammed by audio.c per file
 		.TIM_Prescaler = 4,
 		.TIM_ClockDivision = 0,
 		.TIM_CounterMode = TIM_CounterMode_Up,
 	});
 	TIM_ARRPreloadConfig(TIM2, ENABLE);
 	TIM_ITConfig(TIM2, TIM_IT_CC1, DISABLE);
+	TIM_DMACmd(TIM2, TIM_DMA_CC1, DISABLE);
 	TIM_Cmd(TIM2, ENABLE);
 }
 
+static void init_flash_poll_timer(void) {
+	/* 100us update period; winbond25q64.c only runs it while a program or
+	 * erase operation is in progress */
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
+	TIM_TimeBaseInit(TIM3, &(TIM_TimeBaseInitTypeDef){
+		.TIM_Period = 99,
+		.TIM_Prescaler = 71,
+		.TIM_ClockDivision = 0,
+		.TIM_CounterMode = TIM_CounterMode_Up,
+	});
+	TIM_ClearITPendingBit(TIM3, TIM_IT_Update);
+	TIM_ITConfig(TIM3, TIM_IT_Update, ENABLE);
+}
+
 static void init_adc(void) {
 	RCC_ADCCLKConfig(RCC_PCLK2_Div8);
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_ADC1, ENABLE);
@@ -212,8 +283,12 @@ void system_init(void) {
 	init_crc();
 	init_usart();
 	init_spi();
+	init_spi_dma();
+	init_audio_dma();
+	init_crc_dma();
 	init_pwm();
 	init_pwm_update_timer();
+	init_flash_poll_timer();
 	init_adc();
 	init_nvic();
 	init_systick();
@@ -25,7 +25,6 @@
 #define __INIT_H__
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-void init_spi_dma(void *vdata, unsigned int length);
 void system_init(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -42,6 +42,22 @@
  * shut off */
 #define TIMEOUT_SHUTOFF_AFTER_IDLE_SECS				(10 * 60)
 
+/* Engine revs are the Q8 playback speed of the engine voice. They jump up when
+ * the engine has started and with every button press while it is running,
+ * then settle back to idle. */
+#define ENGINE_REV_IDLE								256
+#define ENGINE_REV_AFTER_START						384
+#define ENGINE_REV_MAX								512
+#define ENGINE_REV_BUTTON_INCREMENT					48
+
+/* Holding the parent button for this long (in 10ms ticks) switches to the
+ * next sound bank; a shorter press changes the volume when released. */
+#define PARENT_BUTTON_LONG_PRESS_TICKS				150
+
+/* A turn signal clip without cues is a single click which the audio sequencer
+ * repeats at this interval; each click toggles the lights. */
+#define TURN_SIGNAL_CLICK_INTERVAL_MS				370
+
 enum ignition_state_t {
 	IGNITION_UNDEFINED,
 	IGNITION_ON,
@@ -92,7 +108,6 @@ struct uistate_t {
 	bool siren_blink;
 
 	unsigned int undervoltage_tick;
-	unsigned int audio_trigger_point_index;
 
 	struct debounce_t button_left;
 	struct debounce_t button_right;
@@ -110,6 +125,15 @@ struct uistate_t {
 	unsigned int shutoff_tick;			/* Ignition off, turn off device */
 
 	unsigned int audio_volume;
+	unsigned int engine_rev;
+	unsigned int parent_button_hold_tick;
+};
+
+/* German two-tone "Martinshorn", A4 and D5; the siren lights alternate with
+ * the tones */
+static const struct audio_synth_tone_t siren_tones[] = {
+	{ .frequency = 440 * 16, .duration_ms = 650, .light_state = AUDIO_LIGHT_SIREN_BLINK },
+	{ .frequency = 587 * 16, .duration_ms = 650, .light_state = 0 },
 };
 
 static volatile unsigned int timectr = 0;
@@ -126,6 +150,8 @@ static struct uistate_t ui = {
 	.button_ignition_ccw.config = &default_button_config,
 	.ignition_state.config = &default_button_config,
 	.audio_volume = 1,
+	.engine_rev = ENGINE_REV_IDLE,
+	.parent_button_hold_tick = PARENT_BUTTON_LONG_PRESS_TICKS,
 };
 
 static void hard_shutoff(void) {
@@ -220,20 +246,38 @@ static enum ignition_state_t determine_ignition_state(void) {
 void audio_trigger_end_of_sample(unsigned int fileno) {
 	if (fileno == FILENO_ENGINE_START) {
 		/* Start of engine is finished */
+		if (ui.engine_state == ENGINE_CRANKING) {
+			ui.engine_rev = ENGINE_REV_AFTER_START;
+		}
 		ui.engine_state = ENGINE_ON;
 	} else if (fileno == FILENO_ENGINE_STOP) {
 		ui.engine_state = ENGINE_OFF;
 	}
 }
 
-void audio_trigger_point(void) {
-	ui.turn_signal_tick = 0;
-	ui.turn_signal_blink = !ui.turn_signal_blink;
+/* Lights toggle in sync with the clicks, whether they come from cues or from
+ * the sequencer */
+static void ui_turn_signal_click(unsigned int fileno) {
+	if (fileno == FILENO_TURN_SIGNAL) {
+		ui.turn_signal_tick = 0;
+		ui.turn_signal_blink = !ui.turn_signal_blink;
+	}
+}
+
+void audio_trigger_cue_point(unsigned int fileno, unsigned int cue_index) {
+	ui_turn_signal_click(fileno);
+}
+
+void audio_trigger_sequence_step(unsigned int fileno) {
+	ui_turn_signal_click(fileno);
 }
 
 static bool is_turn_signal_audible(void) {
-	int audio_fileno = audio_current_fileno();
-	return (audio_fileno == FILENO_TURN_SIGNAL_NO_ENGINE) || (audio_fileno == FILENO_TURN_SIGNAL_WITH_ENGINE);
+	/* Without cues or sequencer, the lights blink on their own timer */
+	if (audio_voice_sequence_fileno(VOICE_TURN_SIGNAL) == FILENO_TURN_SIGNAL) {
+		return true;
+	}
+	return (audio_voice_fileno(VOICE_TURN_SIGNAL) == FILENO_TURN_SIGNAL) && (audio_file_cue_count(FILENO_TURN_SIGNAL) > 0);
 }
 
 static void ignition_off_powersave_mode(void) {
@@ -267,10 +311,22 @@ static void ignition_off_powersave_mode(void) {
 }
 
 static void ui_set_counters(void) {
-	ui.siren_tick++;
-	if (ui.siren_tick >= 20) {
-		ui.siren_tick = 0;
-		ui.siren_blink = !ui.siren_blink;
+	uint8_t light_state;
+	if (audio_light_poll(&light_state)) {
+		ui.siren_blink = light_state & AUDIO_LIGHT_SIREN_BLINK;
+	}
+	if (!audio_light_track_active()) {
+		/* No light track playing, siren blinks on its own */
+		ui.siren_tick++;
+		if (ui.siren_tick >= 20) {
+			ui.siren_tick = 0;
+			ui.siren_blink = !ui.siren_blink;
+		}
+	}
+
+	if (ui.engine_rev > ENGINE_REV_IDLE) {
+		/* Exponential decay back to idle, under two seconds from full revs */
+		ui.engine_rev -= (ui.engine_rev - ENGINE_REV_IDLE + 31) / 32;
 	}
 
 	if (!is_turn_signal_audible()) {
@@ -308,6 +364,13 @@ static void ui_set_counters(void) {
 static void ui_have_action(void) {
 	ui.no_action_tick = 0;
 	ui.hibernation = false;
+	if (ui.engine_state == ENGINE_ON) {
+		/* Repeated button activity revs the engine up */
+		ui.engine_rev += ENGINE_REV_BUTTON_INCREMENT;
+		if (ui.engine_rev > ENGINE_REV_MAX) {
+			ui.engine_rev = ENGINE_REV_MAX;
+		}
+	}
 }
 
 static void ui_handle_undervoltage(void) {
@@ -360,9 +423,19 @@ static void ui_handle_turn_signal_buttons(void) {
 }
 
 static void ui_handle_parent_button(void) {
-	if (debounce_button_active(&ui.button_parent, button_parent_is_active())) {
-		ui_have_action();
-
+	const bool changed = debounce_button(&ui.button_parent, button_parent_is_active());
+	if (ui.button_parent.last_state) {
+		if (changed) {
+			ui_have_action();
+			ui.parent_button_hold_tick = 0;
+		}
+		ui.parent_button_hold_tick++;
+		if ((ui.parent_button_hold_tick == PARENT_BUTTON_LONG_PRESS_TICKS) && (audio_bank_count() > 1)) {
+			audio_select_bank((audio_active_bank() + 1) % audio_bank_count());
+			printf("Sound bank %u: %s\n", audio_active_bank(), audio_bank_name(audio_active_bank()));
+		}
+	} else if (changed && (ui.parent_button_hold_tick < PARENT_BUTTON_LONG_PRESS_TICKS)) {
+		/* Short press released */
 		ui.audio_volume = ui.audio_volume + 1;
 		if (ui.audio_volume == 5) {
 			ui.audio_volume = 0;
@@ -479,33 +552,60 @@ void ui_shutoff(void) {
 }
 
 static void ui_check_audio(void) {
-	int play_fileno = -1;
+	int engine_fileno = -1;
 	if (ui.engine_state == ENGINE_CRANKING) {
-		play_fileno = FILENO_ENGINE_START;
+		engine_fileno = FILENO_ENGINE_START;
 	} else if (ui.engine_state == ENGINE_SHUTTING_OFF) {
-		play_fileno = FILENO_ENGINE_STOP;
+		engine_fileno = FILENO_ENGINE_STOP;
 	} else if (ui.engine_state == ENGINE_ON) {
-		if ((ui.siren == SIREN_HORN_ON) || (ui.siren == SIREN_LIGHTS_AND_HORN_ON)) {
-			play_fileno = FILENO_SIREN_WITH_ENGINE;
-		} else if (ui.turn_signal != TURN_OFF) {
-			play_fileno = FILENO_TURN_SIGNAL_WITH_ENGINE;
-		} else {
-			play_fileno = FILENO_ENGINE_IDLE;
-		}
-	} else if (ui.engine_state == ENGINE_OFF) {
-		if ((ui.siren == SIREN_HORN_ON) || (ui.siren == SIREN_LIGHTS_AND_HORN_ON)) {
-			play_fileno = FILENO_SIREN_NO_ENGINE;
-		} else if (ui.turn_signal != TURN_OFF) {
-			play_fileno = FILENO_TURN_SIGNAL_NO_ENGINE;
+		if ((audio_voice_fileno(VOICE_ENGINE) == FILENO_ENGINE_START) && audio_file_has_intro(FILENO_ENGINE_START)) {
+			/* Engine start clip loops into idle on its own, no file switch */
+			engine_fileno = FILENO_ENGINE_START;
 		} else {
-			play_fileno = -1;
+			engine_fileno = FILENO_ENGINE_IDLE;
 		}
 	}
 
-	if (play_fileno == -1) {
+	const bool siren_horn = (ui.siren == SIREN_HORN_ON) || (ui.siren == SIREN_LIGHTS_AND_HORN_ON);
+
+	int turn_signal_fileno = -1;
+	if (ui.turn_signal != TURN_OFF) {
+		turn_signal_fileno = FILENO_TURN_SIGNAL;
+	}
+
+	if ((engine_fileno == -1) && !siren_horn && (turn_signal_fileno == -1)) {
 		audio_shutoff();
 	} else {
-		audio_playback_fileno(play_fileno, true);
+		/* Voices are mixed, so the engine keeps running underneath the siren
+		 * and turn signal. The siren is synthesized and needs no flash
+		 * access. */
+		audio_voice_play(VOICE_ENGINE, engine_fileno);
+		audio_voice_set_pitch(VOICE_ENGINE, (ui.engine_state == ENGINE_ON) ? ui.engine_rev : ENGINE_REV_IDLE);
+		if (siren_horn) {
+			audio_voice_play_synth(VOICE_SIREN, siren_tones, sizeof(siren_tones) / sizeof(siren_tones[0]));
+		} else {
+			audio_voice_play_synth(VOICE_SIREN, NULL, 0);
+		}
+		if ((turn_signal_fileno != -1) && (audio_file_cue_count(turn_signal_fileno) == 0)) {
+			/* Single click, repeated by the sequencer */
+			const unsigned int interval = audio_output_sample_rate() * TURN_SIGNAL_CLICK_INTERVAL_MS / 1000;
+			audio_sequence_play(VOICE_TURN_SIGNAL, turn_signal_fileno, audio_output_clock(), interval);
+		} else {
+			audio_voice_play(VOICE_TURN_SIGNAL, turn_signal_fileno);
+		}
+	}
+}
+
+static void ui_prefetch_audio(void) {
+	/* Have the head of the clip which most likely plays next ready */
+	if ((ui.turn_signal == TURN_OFF) && (debounce_button_pending(&ui.button_left) || debounce_button_pending(&ui.button_right))) {
+		audio_prefetch(FILENO_TURN_SIGNAL);
+	} else if ((ui.engine_state == ENGINE_CRANKING) && !audio_file_has_intro(FILENO_ENGINE_START)) {
+		audio_prefetch(FILENO_ENGINE_IDLE);
+	} else if ((ui.engine_state == ENGINE_ON) || (ui.engine_state == ENGINE_CRANKING)) {
+		audio_prefetch(FILENO_ENGINE_STOP);
+	} else if (ui.engine_state == ENGINE_OFF) {
+		audio_prefetch(FILENO_ENGINE_START);
 	}
 }
 
@@ -524,9 +624,16 @@ int main(void) {
 	audio_init();
 	sleep_set_inactive();
 
+	uint32_t last_ticks = systick_get_ticks();
 	while (!ui.disable_ui) {
+		usart_terminal_poll();
+
 		/* Execute roughly 100 Hz */
-		systick_wait();
+		const uint32_t ticks = systick_get_ticks();
+		if (ticks == last_ticks) {
+			continue;
+		}
+		last_ticks = ticks;
 
 		ui_set_counters();
 		ui_handle_undervoltage();
@@ -537,9 +644,12 @@ int main(void) {
 		ui_set_headlights();
 		ui_set_top_leds();
 		ui_check_audio();
+		ui_prefetch_audio();
 		ui_check_siren_light();
 		ui_check_shutoff();
 	}
 
-	while (true);
+	while (true) {
+		usart_terminal_poll();
+	}
 }
@@ -27,7 +27,8 @@
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 void SysTick_Handler(void);
 void audio_trigger_end_of_sample(unsigned int fileno);
-void audio_trigger_point(void);
+void audio_trigger_cue_point(unsigned int fileno, unsigned int cue_index);
+void audio_trigger_sequence_step(unsigned int fileno);
 void ui_shutoff(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
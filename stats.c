@@ -33,3 +33,59 @@ void stats_new_dma(void) {
 void stats_failed_dma(void) {
 	stats_rw.dma_requests_failed++;
 }
+
+void stats_prefetch_hit(void) {
+	stats_rw.audio_prefetch_hits++;
+}
+
+void stats_prefetch_miss(void) {
+	stats_rw.audio_prefetch_misses++;
+}
+
+void stats_cache_hit(unsigned int bytes) {
+	stats_rw.audio_cache_hits++;
+	stats_rw.audio_cache_bytes_saved += bytes;
+}
+
+void stats_cache_miss(void) {
+	stats_rw.audio_cache_misses++;
+}
+
+void stats_render_cycles(unsigned int cycles_per_sample) {
+	stats_rw.audio_render_cycles = cycles_per_sample;
+	if (cycles_per_sample > stats_rw.audio_render_cycles_max) {
+		stats_rw.audio_render_cycles_max = cycles_per_sample;
+	}
+}
+
+void stats_audio_underrun(void) {
+	stats_rw.audio_underrun_samples++;
+}
+
+void stats_audio_refill(unsigned int fill) {
+	stats_rw.audio_refill_fill[(fill < STATS_FILL_BUCKETS) ? fill : (STATS_FILL_BUCKETS - 1)]++;
+}
+
+void stats_audio_dma_latency(unsigned int microseconds) {
+	unsigned int bucket = 0;
+	while ((bucket < STATS_LATENCY_BUCKETS - 1) && (microseconds >= (STATS_LATENCY_MIN_US << bucket))) {
+		bucket++;
+	}
+	stats_rw.audio_dma_latency[bucket]++;
+}
+
+void stats_audio_block_retries(unsigned int retries) {
+	stats_rw.audio_block_retries[(retries < STATS_RETRY_BUCKETS) ? retries : (STATS_RETRY_BUCKETS - 1)]++;
+}
+
+void stats_payload_crc_ok(void) {
+	stats_rw.audio_payload_crc_ok++;
+}
+
+void stats_payload_crc_failed(void) {
+	stats_rw.audio_payload_crc_failed++;
+}
+
+void stats_flash_suspend(void) {
+	stats_rw.flash_suspends++;
+}
@@ -24,9 +24,33 @@
 #ifndef __STATS_H__
 #define __STATS_H__
 
+/* Histogram buckets: ring fill level of the refilled voice in blocks, DMA
+ * request to completion latency in powers of two microseconds (below 64 us,
+ * below 128 us, ...) and retries per block. The last bucket takes everything
+ * above. The struct is sent verbatim by the binary stats command, usartcom
+ * decodes it in this order. */
+#define STATS_FILL_BUCKETS			4
+#define STATS_LATENCY_BUCKETS		8
+#define STATS_LATENCY_MIN_US		64
+#define STATS_RETRY_BUCKETS			4
+
 struct stats_t {
 	unsigned int dma_requests_total;
 	unsigned int dma_requests_failed;
+	unsigned int audio_prefetch_hits;
+	unsigned int audio_prefetch_misses;
+	unsigned int audio_cache_hits;
+	unsigned int audio_cache_misses;
+	unsigned int audio_cache_bytes_saved;
+	unsigned int audio_render_cycles;
+	unsigned int audio_render_cycles_max;
+	unsigned int audio_underrun_samples;
+	unsigned int audio_refill_fill[STATS_FILL_BUCKETS];
+	unsigned int audio_dma_latency[STATS_LATENCY_BUCKETS];
+	unsigned int audio_block_retries[STATS_RETRY_BUCKETS];
+	unsigned int audio_payload_crc_ok;
+	unsigned int audio_payload_crc_failed;
+	unsigned int flash_suspends;
 };
 
 extern const struct stats_t *stats;
@@ -34,6 +58,18 @@ extern const struct stats_t *stats;
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 void stats_new_dma(void);
 void stats_failed_dma(void);
+void stats_prefetch_hit(void);
+void stats_prefetch_miss(void);
+void stats_cache_hit(unsigned int bytes);
+void stats_cache_miss(void);
+void stats_render_cycles(unsigned int cycles_per_sample);
+void stats_audio_underrun(void);
+void stats_audio_refill(unsigned int fill);
+void stats_audio_dma_latency(unsigned int microseconds);
+void stats_audio_block_retries(unsigned int retries);
+void stats_payload_crc_ok(void);
+void stats_payload_crc_failed(void);
+void stats_flash_suspend(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
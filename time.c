@@ -21,6 +21,7 @@
  *	Johannes Bauer <JohannesBauer@gmx.de>
 **/
 
+#include <stm32f10x.h>
 #include "time.h"
 #include "usart_terminal.h"
 
@@ -31,6 +32,18 @@ void systick_wait(void) {
 	while ((old_timectr == timectr));
 }
 
+/* 10ms per tick */
+uint32_t systick_get_ticks(void) {
+	return timectr;
+}
+
+/* SysTick counts core cycles downwards from SysTick->VAL and wraps every
+ * 10ms, so only shorter intervals can be measured */
+uint32_t systick_cycles_since(uint32_t start) {
+	const uint32_t reload = SysTick->LOAD + 1;
+	return (start + reload - SysTick->VAL) % reload;
+}
+
 void SysTick_Handler(void) {
 	timectr++;
 	usart_terminal_tick();
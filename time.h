@@ -24,8 +24,12 @@
 #ifndef __TIME_H__
 #define __TIME_H__
 
+#include <stdint.h>
+
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 void systick_wait(void);
+uint32_t systick_get_ticks(void);
+uint32_t systick_cycles_since(uint32_t start);
 void SysTick_Handler(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -51,6 +51,12 @@ enum commandcodes_t {
 	CMDCODE_ERASE_SECTOR = 3,
 	CMDCODE_WRITE_PAGE = 4,
 	CMDCODE_REBOOT = 5,
+	CMDCODE_GET_STATS = 6,
+	CMDCODE_STREAM_START = 7,
+	CMDCODE_STREAM_DATA = 8,
+	CMDCODE_STREAM_STOP = 9,
+	CMDCODE_ERASE_RANGE = 10,
+	CMDCODE_ERASE_STATUS = 11,
 	CMDCODE_ERROR = 0xdeadbeef,
 };
 
@@ -76,11 +82,28 @@ struct binary_payload_erase_sector_t {
 	uint32_t sector_no;
 } __attribute__ ((packed));
 
+struct binary_payload_erase_range_t {
+	uint32_t start;
+	uint32_t length;
+} __attribute__ ((packed));
+
+struct binary_payload_stream_start_t {
+	uint32_t sample_rate;
+	uint32_t codec;
+} __attribute__ ((packed));
+
+struct binary_payload_stream_credits_t {
+	uint32_t accepted;
+	uint32_t credits;
+} __attribute__ ((packed));
+
 static struct terminal_options_t {
 	uint8_t input_buffer[TERMINAL_BUFFER_SIZE];
 	unsigned int fill;
 	uint32_t ticks;
 	enum protocol_t protocol;
+	volatile bool command_pending;		/* Received, waits for usart_terminal_poll() */
+	volatile bool erase_status_changed;
 } terminal;
 
 static void device_reset(void) {
@@ -113,6 +136,7 @@ static void debug_dma(void) {
 	printf("DMA1 Interrupt Status (ISR): %08lx\n", DMA1->ISR);
 	debug_dma_channel("DMA1_Channel2 (SPI1 RX)", DMA1_Channel2, DMA1->ISR >> (4 * 1));
 	debug_dma_channel("DMA1_Channel3 (SPI1 TX)", DMA1_Channel3, DMA1->ISR >> (4 * 2));
+	debug_dma_channel("DMA1_Channel5 (TIM2 CC1 -> TIM1 CCR1)", DMA1_Channel5, DMA1->ISR >> (4 * 4));
 }
 
 static void debug_spi(void) {
@@ -127,6 +151,29 @@ static void debug_spi(void) {
 	printf("\n");
 }
 
+static void print_histogram(const char *name, const unsigned int *buckets, unsigned int bucket_count) {
+	printf("%s:", name);
+	for (unsigned int i = 0; i < bucket_count; i++) {
+		printf(" %u", buckets[i]);
+	}
+	printf("\n");
+}
+
+static void print_erase_status(const struct spiflash_erase_status_t *status) {
+	if (status->active) {
+		printf("Erase: %lu of %lu bytes checked, %lu done\n", status->checked, status->length, status->done);
+	} else if (status->failed) {
+		printf("Erase failed after %lu ms at %lu of %lu bytes.\n", status->milliseconds, status->done, status->length);
+	} else {
+		printf("Erased %lu of %lu bytes at 0x%lx in %lu operations, %lu bytes were blank; took %lu ms.\n", status->erased, status->length, status->start, status->erase_operations, status->length - status->erased, status->milliseconds);
+	}
+}
+
+/* Called from interrupt context, the status is printed by usart_terminal_poll() */
+static void erase_status_changed(const struct spiflash_erase_status_t *status) {
+	terminal.erase_status_changed = true;
+}
+
 static void short_delay(void) {
 	for (volatile unsigned int i = 0; i < 500000; i++);
 }
@@ -142,15 +189,34 @@ static void clear_command(void) {
 		printf("spi                    SPI debugging.\n");
 		printf("flash-id               Identify the flash ROM.\n");
 		printf("flash-read (offset)    Read bytes from the flash ROM.\n");
+		printf("flash-config [M F W]   Show or set flash reads: M MHz, FAST_READ F, 16 bit frames W\n");
+		printf("flash-bench            Benchmark flash reads at all settings (stops audio)\n");
+		printf("flash-erase (ofs) (n)  Erase a sector aligned range, skipping blank sectors\n");
 		printf("binary                 Switch to binary protocol.\n");
-		printf("play (no)              Playback sample #n\n");
+		printf("play (no|name)         Playback sample #n or by name\n");
 		printf("stop                   Stop audio playback\n");
+		printf("siren (pitch) (tempo)  Set siren pitch and tempo in percent\n");
+		printf("filterbench            Benchmark the output filter\n");
+		printf("bank [no]              List sound banks or select one\n");
 		printf("reset                  Reset the device.\n");
 		printf("led-blink              Make all LEDs blink\n");
 		printf("ws rrggbb              Send raw hex data to WS2812\n");
 	} else if (!strcmp((char*)terminal.input_buffer, "stats")) {
 		printf("DMA requests total : %u\n", stats->dma_requests_total);
 		printf("DMA requests failed: %u\n", stats->dma_requests_failed);
+		printf("Prefetch hits      : %u\n", stats->audio_prefetch_hits);
+		printf("Prefetch misses    : %u\n", stats->audio_prefetch_misses);
+		printf("Cache hits         : %u\n", stats->audio_cache_hits);
+		printf("Cache misses       : %u\n", stats->audio_cache_misses);
+		printf("Cache bytes saved  : %u\n", stats->audio_cache_bytes_saved);
+		printf("Cycles per sample  : %u (max %u)\n", stats->audio_render_cycles, stats->audio_render_cycles_max);
+		printf("Underrun samples   : %u\n", stats->audio_underrun_samples);
+		print_histogram("Ring fill at refill (0, 1, 2, 3+ blocks)", stats->audio_refill_fill, STATS_FILL_BUCKETS);
+		print_histogram("DMA latency (<64us, <128us, ..., >=4ms)", stats->audio_dma_latency, STATS_LATENCY_BUCKETS);
+		print_histogram("Retries per block (0, 1, 2, 3+)", stats->audio_block_retries, STATS_RETRY_BUCKETS);
+		printf("Payload CRC OK     : %u\n", stats->audio_payload_crc_ok);
+		printf("Payload CRC failed : %u\n", stats->audio_payload_crc_failed);
+		printf("Flash suspends     : %u\n", stats->flash_suspends);
 	} else if (!strcmp((char*)terminal.input_buffer, "dma")) {
 		debug_dma();
 	} else if (!strcmp((char*)terminal.input_buffer, "spi")) {
@@ -166,13 +232,82 @@ static void clear_command(void) {
 			printf("%02x", buffer[i]);
 		}
 		printf("\n");
+	} else if (!strncmp((char*)terminal.input_buffer, "flash-erase ", 12)) {
+		char *end;
+		const uint32_t offset = strtoul((char*)terminal.input_buffer + 12, &end, 0);
+		const uint32_t length = strtoul(end, NULL, 0);
+		if (!spiflash_erase_range(offset, length, erase_status_changed)) {
+			printf("Cannot erase %lu bytes at 0x%lx: must be sector aligned, or another erase is running.\n", length, offset);
+		}
+	} else if (!strncmp((char*)terminal.input_buffer, "flash-config", 12)) {
+		static const uint16_t prescalers[] = { SPI_BaudRatePrescaler_2, SPI_BaudRatePrescaler_4, SPI_BaudRatePrescaler_8, SPI_BaudRatePrescaler_16 };
+		char *end;
+		const unsigned int mhz = strtol((char*)terminal.input_buffer + 12, &end, 10);
+		const bool fast_read = strtol(end, &end, 10);
+		const bool wide_frames = strtol(end, NULL, 10);
+		const unsigned int prescaler_count = sizeof(prescalers) / sizeof(prescalers[0]);
+		if (mhz) {
+			/* Fastest clock not above the requested one, at least the slowest */
+			unsigned int i = 0;
+			while ((i < prescaler_count - 1) && (spiflash_prescaler_to_khz(prescalers[i]) > mhz * 1000)) {
+				i++;
+			}
+			if (spiflash_prescaler_to_khz(prescalers[i]) > mhz * 1000) {
+				printf("%u MHz is below the slowest supported clock, using that instead.\n", mhz);
+			}
+			spiflash_set_read_config(&(const struct spiflash_read_config_t){
+				.prescaler = prescalers[i],
+				.fast_read = fast_read,
+				.wide_frames = wide_frames,
+			});
+		}
+		const struct spiflash_read_config_t *config = spiflash_get_read_config();
+		const unsigned int khz = spiflash_prescaler_to_khz(config->prescaler);
+		printf("Flash reads at %u.%u MHz with %s, %d bit frames\n", khz / 1000, khz % 1000 / 100, config->fast_read ? "FAST_READ" : "READ_DATA", config->wide_frames ? 16 : 8);
+	} else if (!strcmp((char*)terminal.input_buffer, "flash-bench")) {
+		audio_shutoff();
+		spiflash_benchmark(0, 64 * 1024);
 	} else if (!strcmp((char*)terminal.input_buffer, "reset")) {
 		device_reset();
 	} else if (!strncmp((char*)terminal.input_buffer, "play ", 5)) {
-		const unsigned int fileno = atoi((char*)terminal.input_buffer + 5);
-		audio_playback_fileno(fileno, true);
+		const char *argument = (char*)terminal.input_buffer + 5;
+		if ((argument[0] >= '0') && (argument[0] <= '9')) {
+			audio_playback_fileno(atoi(argument), true);
+		} else {
+			const int fileno = audio_file_lookup(argument);
+			if (fileno == -1) {
+				printf("No such file: %s\n", argument);
+			} else {
+				printf("%s is file %d\n", argument, fileno);
+				audio_playback_fileno(fileno, true);
+			}
+		}
 	} else if (!strcmp((char*)terminal.input_buffer, "stop")) {
 		audio_shutoff();
+	} else if (!strncmp((char*)terminal.input_buffer, "siren ", 6)) {
+		char *end;
+		const unsigned int pitch = strtol((char*)terminal.input_buffer + 6, &end, 10);
+		const unsigned int tempo = strtol(end, NULL, 10);
+		if ((pitch == 0) || (tempo == 0)) {
+			printf("Pitch and tempo must be given in percent.\n");
+		} else {
+			audio_synth_set_pitch(pitch * 256 / 100);
+			audio_synth_set_tempo(tempo * 256 / 100);
+			printf("Siren pitch %u%%, tempo %u%%\n", pitch, tempo);
+		}
+	} else if (!strcmp((char*)terminal.input_buffer, "bank")) {
+		for (unsigned int i = 0; i < audio_bank_count(); i++) {
+			printf("%c %u: %s\n", (i == audio_active_bank()) ? '*' : ' ', i, audio_bank_name(i));
+		}
+	} else if (!strncmp((char*)terminal.input_buffer, "bank ", 5)) {
+		const unsigned int bank = atoi((char*)terminal.input_buffer + 5);
+		if (audio_select_bank(bank)) {
+			printf("Selected bank %u: %s\n", bank, audio_bank_name(bank));
+		} else {
+			printf("No such bank: %u\n", bank);
+		}
+	} else if (!strcmp((char*)terminal.input_buffer, "filterbench")) {
+		audio_filter_benchmark();
 	} else if (!strcmp((char*)terminal.input_buffer, "led-blink")) {
 		while (true) {
 			printf("Signal LED\n");
@@ -214,8 +349,10 @@ static void clear_command(void) {
 		printf("Now switching to binary protocol.\n");
 		terminal.fill = 0;
 		terminal.protocol = BINARY;
+		/* Audio keeps playing, its flash reads suspend program and erase
+		 * operations. The UI is stopped because the WS2812 output blocks
+		 * interrupts, which would drop received bytes. */
 		ui_shutoff();
-		audio_shutoff();
 	} else {
 		printf("Unknown command: %s\n", (char*)terminal.input_buffer);
 	}
@@ -247,15 +384,58 @@ static void execute_binary_command(struct binary_command_t *command) {
 	} else if ((command->payload.command_code == CMDCODE_READ_PAGE) && (payload_size == sizeof(struct binary_payload_read_page_t))) {
 		const struct binary_payload_read_page_t *payload = (const struct binary_payload_read_page_t*)command->payload.data;
 		uint8_t page_data[SPIFLASH_PAGE_SIZE];
-		spiflash_read(SPIFLASH_PAGE_SIZE * payload->page_no, page_data, sizeof(page_data));
-		binary_reply(command->payload.command_code, page_data, SPIFLASH_PAGE_SIZE);
+		if (spiflash_read(SPIFLASH_PAGE_SIZE * payload->page_no, page_data, sizeof(page_data))) {
+			binary_reply(command->payload.command_code, page_data, SPIFLASH_PAGE_SIZE);
+		} else {
+			binary_reply(CMDCODE_ERROR, NULL, 0);
+		}
 	} else if ((command->payload.command_code == CMDCODE_WRITE_PAGE) && (payload_size == sizeof(struct binary_payload_write_page_t))) {
 		const struct binary_payload_write_page_t *payload = (const struct binary_payload_write_page_t*)command->payload.data;
-		spiflash_write_page(payload->page_no, payload->page_data);
-		binary_reply(command->payload.command_code, NULL, 0);
+		if (spiflash_write_page(payload->page_no, payload->page_data)) {
+			binary_reply(command->payload.command_code, NULL, 0);
+		} else {
+			binary_reply(CMDCODE_ERROR, NULL, 0);
+		}
 	} else if ((command->payload.command_code == CMDCODE_ERASE_SECTOR) && (payload_size == sizeof(struct binary_payload_erase_sector_t))) {
 		const struct binary_payload_erase_sector_t *payload = (const struct binary_payload_erase_sector_t*)command->payload.data;
-		spiflash_erase_sector(payload->sector_no);
+		if (spiflash_erase_sector(payload->sector_no)) {
+			binary_reply(command->payload.command_code, NULL, 0);
+		} else {
+			binary_reply(CMDCODE_ERROR, NULL, 0);
+		}
+	} else if ((command->payload.command_code == CMDCODE_ERASE_RANGE) && (payload_size == sizeof(struct binary_payload_erase_range_t))) {
+		/* Replies right away, the host then polls CMDCODE_ERASE_STATUS */
+		const struct binary_payload_erase_range_t *payload = (const struct binary_payload_erase_range_t*)command->payload.data;
+		if (spiflash_erase_range(payload->start, payload->length, NULL)) {
+			binary_reply(command->payload.command_code, spiflash_erase_status(), sizeof(struct spiflash_erase_status_t));
+		} else {
+			binary_reply(CMDCODE_ERROR, NULL, 0);
+		}
+	} else if (command->payload.command_code == CMDCODE_ERASE_STATUS) {
+		binary_reply(command->payload.command_code, spiflash_erase_status(), sizeof(struct spiflash_erase_status_t));
+	} else if (command->payload.command_code == CMDCODE_GET_STATS) {
+		binary_reply(command->payload.command_code, stats, sizeof(struct stats_t));
+	} else if ((command->payload.command_code == CMDCODE_STREAM_START) && (payload_size == sizeof(struct binary_payload_stream_start_t))) {
+		const struct binary_payload_stream_start_t *payload = (const struct binary_payload_stream_start_t*)command->payload.data;
+		if (audio_live_start(payload->sample_rate, payload->codec)) {
+			const struct binary_payload_stream_credits_t reply = {
+				.credits = audio_live_credits(),
+			};
+			binary_reply(command->payload.command_code, &reply, sizeof(reply));
+		} else {
+			binary_reply(CMDCODE_ERROR, NULL, 0);
+		}
+	} else if (command->payload.command_code == CMDCODE_STREAM_DATA) {
+		/* An empty data frame only polls for credits; a malformed length is
+		 * not accepted */
+		const bool valid_length = (command->total_length >= 12) && (command->total_length <= TERMINAL_BUFFER_SIZE);
+		const struct binary_payload_stream_credits_t reply = {
+			.accepted = valid_length ? audio_live_write(command->payload.data, payload_size) : 0,
+			.credits = audio_live_credits(),
+		};
+		binary_reply(command->payload.command_code, &reply, sizeof(reply));
+	} else if (command->payload.command_code == CMDCODE_STREAM_STOP) {
+		audio_live_stop();
 		binary_reply(command->payload.command_code, NULL, 0);
 	} else if (command->payload.command_code == CMDCODE_REBOOT) {
 		device_reset();
@@ -273,16 +453,17 @@ static void usart_binary_terminal_rx(uint8_t character) {
 	struct binary_command_t *command = (struct binary_command_t*)terminal.input_buffer;
 	if ((terminal.fill >= sizeof(struct binary_command_t)) && (terminal.fill >= command->total_length)) {
 		if (command->crc == compute_crc32(&command->payload, command->total_length - 8)) {
-			execute_binary_command(command);
+			terminal.command_pending = true;
+		} else {
+			terminal.fill = 0;
 		}
-		terminal.fill = 0;
 	}
 }
 
 static void usart_ascii_terminal_rx(char character) {
 	if (character == '\n') {
 	} else if (character == '\r') {
-		clear_command();
+		terminal.command_pending = true;
 	} else if (character == CHAR_BACKSPACE) {
 		if (terminal.fill > 0) {
 			terminal.fill--;
@@ -300,6 +481,10 @@ static void usart_ascii_terminal_rx(char character) {
 }
 
 void usart_terminal_rx(char character) {
+	if (terminal.command_pending) {
+		/* Neither the host nor a typing human send before the reply */
+		return;
+	}
 	terminal.ticks = 0;
 	if (terminal.protocol == ASCII) {
 		usart_ascii_terminal_rx(character);
@@ -310,8 +495,32 @@ void usart_terminal_rx(char character) {
 
 void usart_terminal_tick(void) {
 	terminal.ticks++;
-	if ((terminal.ticks >= TERMINAL_TICK_THRESHOLD) && (terminal.protocol == BINARY)) {
+	if ((terminal.ticks >= TERMINAL_TICK_THRESHOLD) && (terminal.protocol == BINARY) && !terminal.command_pending) {
 		terminal.fill = 0;
 		terminal.ticks = 0;
 	}
 }
+
+/* Commands are executed from the main loop and not from the USART interrupt,
+ * so that they may wait for the flash without blocking the audio interrupts,
+ * which have the same priority. */
+void usart_terminal_poll(void) {
+	if (terminal.erase_status_changed) {
+		terminal.erase_status_changed = false;
+		__disable_irq();
+		const struct spiflash_erase_status_t status = *spiflash_erase_status();
+		__enable_irq();
+		print_erase_status(&status);
+	}
+
+	if (!terminal.command_pending) {
+		return;
+	}
+	if (terminal.protocol == ASCII) {
+		clear_command();
+	} else {
+		execute_binary_command((struct binary_command_t*)terminal.input_buffer);
+		terminal.fill = 0;
+	}
+	terminal.command_pending = false;
+}
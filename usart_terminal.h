@@ -4,6 +4,7 @@
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 void usart_terminal_rx(char character);
 void usart_terminal_tick(void);
+void usart_terminal_poll(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
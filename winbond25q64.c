@@ -26,16 +26,102 @@
 #include <string.h>
 #include <stm32f10x_spi.h>
 #include <stm32f10x_dma.h>
+#include <stm32f10x_tim.h>
 #include "system.h"
 #include "winbond25q64.h"
-#include "init.h"
 #include "stats.h"
+#include "time.h"
+
+/* All flash traffic goes through a queue of transactions, so that audio
+ * streaming, the terminal and flashing never interleave on the bus. A
+ * transaction is submitted with a priority and completed by its callback,
+ * usually from the DMA interrupt, which then starts the next one right away;
+ * audio reads go ahead of maintenance traffic. Transactions belong to the
+ * submitter and must stay valid until they have completed.
+ *
+ * Program and erase operations release the bus once their command has been
+ * sent and then run in the background; TIM3 polls the BUSY bit every 100us.
+ * When an audio read is queued meanwhile, the operation is suspended, the
+ * reads are served and the operation is resumed once no more audio reads are
+ * waiting. Every other transaction waits until the operation has finished. A
+ * resumed operation runs for a minimum time before it may be suspended again,
+ * otherwise back-to-back reads could keep it from ever making progress. */
+#define SPIFLASH_BACKGROUND_MIN_RUN_TICKS	2
+
+enum spiflash_background_state_t {
+	BACKGROUND_RUNNING,
+	BACKGROUND_SUSPENDING,		/* Suspend sent, waiting for BUSY to clear */
+	BACKGROUND_SUSPENDED,
+};
 
 static volatile enum dma_state_t dma_state;
-
-enum dma_state_t spiflash_get_dma_state(void) {
-	return dma_state;
-}
+static bool dma_keep_cs_active;
+static struct {
+	uint16_t *data;			/* NULL unless the transfer in flight uses 16 bit frames */
+	unsigned int halfwords;
+} dma_wide;
+
+static struct {
+	struct spiflash_transaction_t *head[SPIFLASH_PRIORITY_COUNT];
+	struct spiflash_transaction_t *tail[SPIFLASH_PRIORITY_COUNT];
+	struct spiflash_transaction_t *active;		/* NULL when the bus is idle */
+	bool completing;							/* Submissions are only queued meanwhile */
+} queue;
+static struct {
+	struct spiflash_transaction_t *transaction;	/* Program or erase in progress, NULL if none */
+	enum spiflash_background_state_t state;
+	unsigned int run_ticks;
+} background;
+static uint8_t rx_discard;
+
+/* SPI1 runs from the 72 MHz APB2 clock, prescalers 2 to 256 give 36 MHz down
+ * to 281 kHz. FAST_READ sends a dummy byte after the address and is specified
+ * for higher clocks than READ_DATA. With wide frames, the data phase of DMA
+ * reads runs in 16 bit SPI frames, which halves the number of DMA transfers;
+ * the flash sends the high byte first, so each halfword is swapped back once
+ * the transfer is complete. Odd lengths fall back to 8 bit frames. */
+static struct spiflash_read_config_t read_config = {
+	.prescaler = SPI_BaudRatePrescaler_8,
+	.fast_read = false,
+	.wide_frames = false,
+};
+
+/* Erase granularities from the largest to the smallest with their typical
+ * erase time from the W25Q64FV datasheet. A chip erase cannot be suspended,
+ * audio reads therefore stall until it has finished. */
+static const struct spiflash_erase_granularity_t {
+	uint32_t size;
+	uint8_t instruction;
+	uint16_t typical_ms;
+} erase_granularities[] = {
+	{ SPIFLASH_SIZE, SPIFLASH_CHIP_ERASE, 20000 },
+	{ 64 * 1024, SPIFLASH_BLOCK_ERASE_64K, 150 },
+	{ 32 * 1024, SPIFLASH_BLOCK_ERASE_32K, 120 },
+	{ SPIFLASH_SECTOR_SIZE, SPIFLASH_SECTOR_ERASE, 45 },
+};
+#define SPIFLASH_ERASE_GRANULARITY_COUNT	(sizeof(erase_granularities) / sizeof(erase_granularities[0]))
+
+/* An erase range is first blank checked sector by sector, reading until the
+ * first byte that is not 0xff. The erase pass then picks the granularity
+ * with the lowest typical erase time for the dirty sectors it covers, and
+ * skips blank regions altogether. */
+static struct {
+	struct spiflash_erase_status_t status;
+	spiflash_erase_callback_t callback;
+	struct spiflash_transaction_t transaction;
+	uint32_t position;
+	bool checking;
+	uint32_t start_ticks;
+	uint32_t check_data[128];
+	uint8_t dirty_sectors[SPIFLASH_SIZE / SPIFLASH_SECTOR_SIZE / 8];
+} erase_plan;
+
+/* A read stream keeps chip select asserted after a DMA read completes so that
+ * the next sequential read can continue without re-sending the command. */
+static struct {
+	bool open;
+	uint32_t next_address;
+} read_stream;
 
 static uint8_t spiflash_txrx_byte(uint8_t send_byte) {
 	/* Wait until transmit register empty, then send */
@@ -54,14 +140,51 @@ static void spiflash_txrx_raw(void *vdata, unsigned int length) {
 	}
 }
 
+static void spiflash_set_frame_width(bool wide) {
+	const uint16_t dff = wide ? SPI_CR1_DFF : 0;
+	if ((SPI1->CR1 & SPI_CR1_DFF) == dff) {
+		return;
+	}
+
+	/* The frame format may only be changed while SPI is disabled */
+	while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY) == SET);
+	SPI1->CR1 &= ~SPI_CR1_SPE;
+	SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_DFF) | dff;
+	SPI1->CR1 |= SPI_CR1_SPE;
+}
+
+static void spiflash_stream_end(void) {
+	if (read_stream.open) {
+		read_stream.open = false;
+		w25qxx_cs_set_inactive();
+		spiflash_set_frame_width(false);
+	}
+}
+
+/* Releases chip select after reads, unless a transaction is running */
+void spiflash_stream_close(void) {
+	const uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (!queue.active) {
+		spiflash_stream_end();
+	}
+	__set_PRIMASK(primask);
+}
+
 static void spiflash_txrx(void *vdata, unsigned int length) {
 	w25qxx_cs_set_active();
 	spiflash_txrx_raw(vdata, length);
 	w25qxx_cs_set_inactive();
 }
 
+static void spiflash_dma_finished(void);
+
 void SPI1_Handler(void) {
 	/* SPI1 OVR -> Error; abort DMA */
+	if (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_OVR) == RESET) {
+		/* Only the error interrupt is enabled, nothing else to handle */
+		return;
+	}
 	stats_failed_dma();
 
 	DMA_Channel_TypeDef *dma_channel_rx = DMA1_Channel2;
@@ -75,8 +198,12 @@ void SPI1_Handler(void) {
 	(void)SPI1->SR; /* Read out SR */
 
 	SPI_I2S_ClearITPendingBit(SPI1, SPI_I2S_IT_ERR);
+	read_stream.open = false;
 	w25qxx_cs_set_inactive();
+	spiflash_set_frame_width(false);
+	dma_wide.data = NULL;
 	dma_state = DMA_ERROR;
+	spiflash_dma_finished();
 }
 
 void DMA1_Channel2_Handler(void) {
@@ -85,10 +212,19 @@ void DMA1_Channel2_Handler(void) {
 		SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx, DISABLE);
 		DMA_ClearITPendingBit(DMA1_IT_TC2);
 		DMA_Cmd(dma_channel_rx, DISABLE);
-		w25qxx_cs_set_inactive();
+		if (!dma_keep_cs_active) {
+			w25qxx_cs_set_inactive();
+		}
+		if (dma_wide.data) {
+			for (unsigned int i = 0; i < dma_wide.halfwords; i++) {
+				dma_wide.data[i] = __REV16(dma_wide.data[i]);
+			}
+			dma_wide.data = NULL;
+		}
 		if (dma_state == DMA_IN_PROGRESS) {
 			dma_state = DMA_SUCCESS;
 		}
+		spiflash_dma_finished();
 	}
 }
 
@@ -100,47 +236,247 @@ void DMA1_Channel3_Handler(void) {
 	}
 }
 
-void spiflash_txrx_dma(void *vdata, unsigned int length) {
+/* Received data goes to rx_data; if that is NULL, it is discarded */
+static void spiflash_dma_start(const void *tx_data, void *rx_data, unsigned int length, bool wide) {
 	dma_state = DMA_IN_PROGRESS;
 	stats_new_dma();
 
-	w25qxx_cs_set_active();
+	/* Both channels have been fully configured once by init_spi_dma(), only
+	 * re-arm them here by touching the registers which actually change. This
+	 * is called from interrupt context when streaming. */
 	DMA_Channel_TypeDef *dma_channel_tx = DMA1_Channel3;
 	DMA_Channel_TypeDef *dma_channel_rx = DMA1_Channel2;
+	dma_channel_tx->CCR &= ~DMA_CCR3_EN;
+	dma_channel_rx->CCR &= ~DMA_CCR2_EN;
+	DMA1->IFCR = DMA1_FLAG_TC3 | DMA1_FLAG_TE3 | DMA1_FLAG_HT3 | DMA1_FLAG_TC2 | DMA1_FLAG_TE2 | DMA1_FLAG_HT2;
+	if (wide) {
+		dma_wide.data = (uint16_t*)rx_data;
+		dma_wide.halfwords = length / 2;
+		length /= 2;
+		dma_channel_rx->CCR = (dma_channel_rx->CCR & ~(DMA_CCR2_PSIZE | DMA_CCR2_MSIZE)) | DMA_CCR2_PSIZE_0 | DMA_CCR2_MSIZE_0;
+		dma_channel_tx->CCR = (dma_channel_tx->CCR & ~(DMA_CCR3_PSIZE | DMA_CCR3_MSIZE)) | DMA_CCR3_PSIZE_0 | DMA_CCR3_MSIZE_0;
+	} else {
+		dma_wide.data = NULL;
+		dma_channel_rx->CCR &= ~(DMA_CCR2_PSIZE | DMA_CCR2_MSIZE);
+		dma_channel_tx->CCR &= ~(DMA_CCR3_PSIZE | DMA_CCR3_MSIZE);
+	}
+	if (rx_data) {
+		dma_channel_rx->CCR |= DMA_CCR2_MINC;
+		dma_channel_rx->CMAR = (uint32_t)rx_data;
+	} else {
+		dma_channel_rx->CCR &= ~DMA_CCR2_MINC;
+		dma_channel_rx->CMAR = (uint32_t)&rx_discard;
+	}
+	dma_channel_rx->CNDTR = length;
+	dma_channel_tx->CMAR = (uint32_t)tx_data;
+	dma_channel_tx->CNDTR = length;
+	dma_channel_rx->CCR |= DMA_CCR2_EN;
+	dma_channel_tx->CCR |= DMA_CCR3_EN;
+	SPI1->CR2 |= SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx;
+}
 
-	DMA_ClearFlag(DMA1_FLAG_TC3 | DMA1_FLAG_TE3 | DMA1_FLAG_HT3 | DMA1_FLAG_TC2 | DMA1_FLAG_TE2 | DMA1_FLAG_HT2);
-	init_spi_dma(vdata, length);
+/* Chip select must be active already */
+static void spiflash_send_read_command(uint32_t address) {
+	uint8_t command[5] = { read_config.fast_read ? SPIFLASH_FAST_READ : SPIFLASH_READ_DATA, (address >> 16) & 0xff, (address >> 8) & 0xff, (address >> 0) & 0xff, 0 };
+	spiflash_txrx_raw(command, read_config.fast_read ? 5 : 4);
+}
 
-	DMA_Cmd(dma_channel_tx, ENABLE);
-	DMA_Cmd(dma_channel_rx, ENABLE);
-	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx, ENABLE);
+static void spiflash_send_instruction(uint8_t instruction) {
+	spiflash_txrx(&instruction, 1);
 }
 
-//static bool dma_channel_active(DMA_Channel_TypeDef *dma_channel) {
-//	return (dma_channel->CCR) & 1;
-//}
+static uint8_t spiflash_poll_status(void) {
+	uint8_t data[2] = { SPIFLASH_READ_STATUS1 };
+	spiflash_txrx(data, sizeof(data));
+	return data[1];
+}
 
-static void spiflash_dma_wait(void) {
-//	DMA_Channel_TypeDef *dma_channel_tx = DMA1_Channel3;
-//	DMA_Channel_TypeDef *dma_channel_rx = DMA1_Channel2;
-	while (dma_state == DMA_IN_PROGRESS);
-//	while ((dma_channel_active(dma_channel_tx)) || (dma_channel_active(dma_channel_rx)));
+static void spiflash_start_background(struct spiflash_transaction_t *transaction) {
+	queue.active = NULL;
+	background.transaction = transaction;
+	background.state = BACKGROUND_RUNNING;
+	background.run_ticks = 0;
+	TIM_SetCounter(TIM3, 0);
+	TIM_Cmd(TIM3, ENABLE);
 }
 
-struct spiflash_manufacturer_t spiflash_read_id(void) {
-	uint8_t data[6] = { SPIFLASH_READ_MANUFACTURER };
-	spiflash_txrx(data, sizeof(data));
+static void spiflash_start(struct spiflash_transaction_t *transaction) {
+	queue.active = transaction;
+	const uint32_t address = transaction->address;
+	if (transaction->type == SPIFLASH_TRANSACTION_READ) {
+		if ((!read_stream.open) || (read_stream.next_address != address)) {
+			/* Not a continuation of the previous read, (re-)issue the command */
+			spiflash_stream_end();
+			w25qxx_cs_set_active();
+			spiflash_send_read_command(address);
+			read_stream.open = true;
+		}
+		const bool wide = read_config.wide_frames && ((transaction->length % 2) == 0) && (((uint32_t)transaction->data % 2) == 0);
+		spiflash_set_frame_width(wide);
+		read_stream.next_address = address + transaction->length;
+		dma_keep_cs_active = true;
+		spiflash_dma_start(transaction->data, transaction->data, transaction->length, wide);
+	} else if (transaction->type == SPIFLASH_TRANSACTION_COMMAND) {
+		spiflash_stream_end();
+		w25qxx_cs_set_active();
+		dma_keep_cs_active = false;
+		spiflash_dma_start(transaction->data, transaction->data, transaction->length, false);
+	} else if (transaction->type == SPIFLASH_TRANSACTION_PROGRAM_PAGE) {
+		uint8_t command[4] = { SPIFLASH_PAGE_PROGRAM, (address >> 16) & 0xff, (address >> 8) & 0xff, (address >> 0) & 0xff };
+		spiflash_stream_end();
+		spiflash_send_instruction(SPIFLASH_WRITE_ENABLE);
+		w25qxx_cs_set_active();
+		spiflash_txrx_raw(command, sizeof(command));
+		dma_keep_cs_active = false;
+		spiflash_dma_start(transaction->data, NULL, transaction->length, false);
+	} else if (transaction->type == SPIFLASH_TRANSACTION_ERASE) {
+		uint8_t command[4] = { SPIFLASH_SECTOR_ERASE, (address >> 16) & 0xff, (address >> 8) & 0xff, (address >> 0) & 0xff };
+		for (unsigned int i = 0; i < SPIFLASH_ERASE_GRANULARITY_COUNT; i++) {
+			if (erase_granularities[i].size == transaction->length) {
+				command[0] = erase_granularities[i].instruction;
+			}
+		}
+		spiflash_stream_end();
+		spiflash_send_instruction(SPIFLASH_WRITE_ENABLE);
+		spiflash_txrx(command, (command[0] == SPIFLASH_CHIP_ERASE) ? 1 : sizeof(command));
+		spiflash_start_background(transaction);
+	}
+}
 
-	return (struct spiflash_manufacturer_t){
-		.manufacturer_id = data[4],
-		.device_id = data[5],
+static void spiflash_start_next(void) {
+	if (queue.active || queue.completing) {
+		return;
+	}
+	unsigned int priority_count = SPIFLASH_PRIORITY_COUNT;
+	if (background.transaction) {
+		/* Only audio reads may run, and only while the operation is suspended.
+		 * Maintenance transactions wait until it has finished; their
+		 * submitters must therefore never wait for them in interrupt
+		 * context. */
+		if (background.state != BACKGROUND_SUSPENDED) {
+			return;
+		}
+		if (!queue.head[SPIFLASH_PRIORITY_AUDIO]) {
+			spiflash_stream_end();
+			spiflash_send_instruction(SPIFLASH_ERASE_PROGRAM_RESUME);
+			background.state = BACKGROUND_RUNNING;
+			background.run_ticks = 0;
+			return;
+		}
+		priority_count = SPIFLASH_PRIORITY_AUDIO + 1;
+	}
+	for (unsigned int priority = 0; priority < priority_count; priority++) {
+		struct spiflash_transaction_t *transaction = queue.head[priority];
+		if (transaction) {
+			queue.head[priority] = transaction->next;
+			if (!queue.head[priority]) {
+				queue.tail[priority] = NULL;
+			}
+			spiflash_start(transaction);
+			return;
+		}
+	}
+}
+
+static void spiflash_complete(enum dma_state_t state) {
+	struct spiflash_transaction_t *transaction = queue.active;
+	queue.active = NULL;
+	transaction->state = state;
+	if (transaction->callback) {
+		/* The highest priority transaction goes next, even if the callback
+		 * submits another one */
+		queue.completing = true;
+		transaction->callback(transaction);
+		queue.completing = false;
+	}
+	spiflash_start_next();
+}
+
+static void spiflash_dma_finished(void) {
+	if (!queue.active) {
+		return;
+	}
+	if (dma_state != DMA_SUCCESS) {
+		spiflash_complete(dma_state);
+	} else if (queue.active->type == SPIFLASH_TRANSACTION_PROGRAM_PAGE) {
+		/* Chip select has been released, which starts programming */
+		spiflash_start_background(queue.active);
+	} else {
+		spiflash_complete(DMA_SUCCESS);
+	}
+}
+
+void TIM3_Handler(void) {
+	if (TIM_GetITStatus(TIM3, TIM_IT_Update) == RESET) {
+		return;
+	}
+	TIM_ClearITPendingBit(TIM3, TIM_IT_Update);
+	if ((!background.transaction) || queue.active || (background.state == BACKGROUND_SUSPENDED)) {
+		/* Reads in progress, the operation is resumed once they are done */
+		return;
+	}
+
+	if (background.state == BACKGROUND_RUNNING) {
+		background.run_ticks++;
+		const bool suspendable = (background.transaction->type != SPIFLASH_TRANSACTION_ERASE) || (background.transaction->length != SPIFLASH_SIZE);
+		if (suspendable && queue.head[SPIFLASH_PRIORITY_AUDIO] && (background.run_ticks >= SPIFLASH_BACKGROUND_MIN_RUN_TICKS)) {
+			/* Ignored by the flash if the operation has just finished */
+			spiflash_send_instruction(SPIFLASH_ERASE_PROGRAM_SUSPEND);
+			background.state = BACKGROUND_SUSPENDING;
+			stats_flash_suspend();
+			return;
+		}
+	}
+
+	if (spiflash_poll_status() & SPIFLASH_STATUS_BUSY) {
+		return;
+	}
+	if (background.state == BACKGROUND_SUSPENDING) {
+		background.state = BACKGROUND_SUSPENDED;
+		spiflash_start_next();
+	} else {
+		TIM_Cmd(TIM3, DISABLE);
+		queue.active = background.transaction;
+		background.transaction = NULL;
+		spiflash_complete(DMA_SUCCESS);
+	}
+}
+
+/* May be called from interrupt context, the callback then may run before this
+ * returns */
+void spiflash_submit(struct spiflash_transaction_t *transaction, enum spiflash_priority_t priority) {
+	const uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	transaction->state = DMA_IN_PROGRESS;
+	transaction->next = NULL;
+	if (queue.tail[priority]) {
+		queue.tail[priority]->next = transaction;
+	} else {
+		queue.head[priority] = transaction;
+	}
+	queue.tail[priority] = transaction;
+	spiflash_start_next();
+	__set_PRIMASK(primask);
+}
+
+/* Maintenance transaction which is waited for. Only call this from the main
+ * loop: it relies on the DMA and TIM3 interrupts to complete the transaction,
+ * which also waits for a program or erase operation in progress. */
+static enum dma_state_t spiflash_transact(enum spiflash_transaction_type_t type, uint32_t address, void *data, unsigned int length) {
+	struct spiflash_transaction_t transaction = {
+		.type = type,
+		.address = address,
+		.data = data,
+		.length = length,
 	};
+	spiflash_submit(&transaction, SPIFLASH_PRIORITY_MAINTENANCE);
+	while (transaction.state == DMA_IN_PROGRESS);
+	return transaction.state;
 }
 
-struct spiflash_manufacturer_t spiflash_read_id_dma(void) {
+struct spiflash_manufacturer_t spiflash_read_id(void) {
 	uint8_t data[6] = { SPIFLASH_READ_MANUFACTURER };
-	spiflash_txrx_dma(data, 6);
-	spiflash_dma_wait();
+	spiflash_transact(SPIFLASH_TRANSACTION_COMMAND, 0, data, sizeof(data));
 	return (struct spiflash_manufacturer_t){
 		.manufacturer_id = data[4],
 		.device_id = data[5],
@@ -152,66 +488,270 @@ uint16_t spiflash_read_status(void) {
 
 	{
 		uint8_t data[2] = { SPIFLASH_READ_STATUS1 };
-		spiflash_txrx(data, sizeof(data));
+		spiflash_transact(SPIFLASH_TRANSACTION_COMMAND, 0, data, sizeof(data));
 		status |= data[1];
 	}
 	{
 		uint8_t data[2] = { SPIFLASH_READ_STATUS2 };
-		spiflash_txrx(data, sizeof(data));
+		spiflash_transact(SPIFLASH_TRANSACTION_COMMAND, 0, data, sizeof(data));
 		status |= (data[1] << 8);
 	}
 
 	return status;
 }
 
-void spiflash_wait_finished(void) {
-	uint16_t status;
-	do {
-		status = spiflash_read_status();
-	} while (status & SPIFLASH_STATUS_BUSY);
+bool spiflash_erase_sector(unsigned int sector_no) {
+	return spiflash_transact(SPIFLASH_TRANSACTION_ERASE, sector_no * SPIFLASH_SECTOR_SIZE, NULL, SPIFLASH_SECTOR_SIZE) == DMA_SUCCESS;
 }
 
-void spiflash_erase_sector(unsigned int sector_no) {
-	{
-		uint8_t data[1] = { SPIFLASH_WRITE_ENABLE };
-		spiflash_txrx(data, sizeof(data));
+static bool spiflash_region_dirty(uint32_t address, uint32_t size) {
+	for (uint32_t sector_no = address / SPIFLASH_SECTOR_SIZE; sector_no < (address + size) / SPIFLASH_SECTOR_SIZE; sector_no++) {
+		if (erase_plan.dirty_sectors[sector_no / 8] & (1 << (sector_no % 8))) {
+			return true;
+		}
 	}
-	{
-		const unsigned int address = sector_no * SPIFLASH_SECTOR_SIZE;
-		uint8_t data[4] = { SPIFLASH_SECTOR_ERASE, (address >> 16) & 0xff, (address >> 8) & 0xff, (address >> 0) & 0xff };
-		spiflash_txrx(data, sizeof(data));
-		spiflash_wait_finished();
+	return false;
+}
+
+/* Typical time to erase the dirty sectors of an aligned region in ms */
+static unsigned int spiflash_erase_cost(uint32_t address, unsigned int granularity);
+
+static unsigned int spiflash_erase_subregion_cost(uint32_t address, unsigned int granularity) {
+	const uint32_t size = erase_granularities[granularity].size;
+	const uint32_t subregion_size = erase_granularities[granularity + 1].size;
+	unsigned int cost = 0;
+	for (uint32_t offset = 0; offset < size; offset += subregion_size) {
+		cost += spiflash_erase_cost(address + offset, granularity + 1);
+	}
+	return cost;
+}
+
+static unsigned int spiflash_erase_cost(uint32_t address, unsigned int granularity) {
+	if (!spiflash_region_dirty(address, erase_granularities[granularity].size)) {
+		return 0;
+	}
+	const unsigned int cost = erase_granularities[granularity].typical_ms;
+	if (granularity == SPIFLASH_ERASE_GRANULARITY_COUNT - 1) {
+		return cost;
+	}
+	const unsigned int subregion_cost = spiflash_erase_subregion_cost(address, granularity);
+	return (subregion_cost < cost) ? subregion_cost : cost;
+}
+
+static void spiflash_erase_plan_report(void) {
+	erase_plan.status.milliseconds = (systick_get_ticks() - erase_plan.start_ticks) * 10;
+	if (erase_plan.callback) {
+		erase_plan.callback(&erase_plan.status);
+	}
+}
+
+static void spiflash_erase_plan_finish(bool success) {
+	erase_plan.status.active = false;
+	erase_plan.status.failed = !success;
+	spiflash_erase_plan_report();
+}
+
+static void spiflash_erase_plan_continue(struct spiflash_transaction_t *transaction);
+
+static void spiflash_erase_plan_submit(enum spiflash_transaction_type_t type, void *data, unsigned int length) {
+	erase_plan.transaction = (struct spiflash_transaction_t){
+		.type = type,
+		.address = erase_plan.position,
+		.data = data,
+		.length = length,
+		.callback = spiflash_erase_plan_continue,
+	};
+	spiflash_submit(&erase_plan.transaction, SPIFLASH_PRIORITY_MAINTENANCE);
+}
+
+static void spiflash_erase_plan_next_erase(void) {
+	const uint32_t end = erase_plan.status.start + erase_plan.status.length;
+	while (erase_plan.position < end) {
+		for (unsigned int i = 0; i < SPIFLASH_ERASE_GRANULARITY_COUNT; i++) {
+			const uint32_t size = erase_granularities[i].size;
+			if ((erase_plan.position % size) || (erase_plan.position + size > end)) {
+				continue;
+			}
+			if (!spiflash_region_dirty(erase_plan.position, size)) {
+				erase_plan.position += size;
+				erase_plan.status.done += size;
+				break;
+			}
+			if ((i == SPIFLASH_ERASE_GRANULARITY_COUNT - 1) || (erase_granularities[i].typical_ms <= spiflash_erase_subregion_cost(erase_plan.position, i))) {
+				spiflash_erase_plan_submit(SPIFLASH_TRANSACTION_ERASE, NULL, size);
+				return;
+			}
+		}
 	}
+	spiflash_erase_plan_finish(true);
+}
+
+static void spiflash_erase_plan_continue(struct spiflash_transaction_t *transaction) {
+	if (transaction->state != DMA_SUCCESS) {
+		spiflash_erase_plan_finish(false);
+		return;
+	}
+
+	if (!erase_plan.checking) {
+		erase_plan.position += transaction->length;
+		erase_plan.status.done += transaction->length;
+		erase_plan.status.erased += transaction->length;
+		erase_plan.status.erase_operations++;
+		spiflash_erase_plan_report();
+		spiflash_erase_plan_next_erase();
+		return;
+	}
+
+	bool blank = true;
+	for (unsigned int i = 0; i < transaction->length / 4; i++) {
+		if (erase_plan.check_data[i] != 0xffffffff) {
+			blank = false;
+			break;
+		}
+	}
+	if (blank) {
+		erase_plan.position += transaction->length;
+	} else {
+		const uint32_t sector_no = erase_plan.position / SPIFLASH_SECTOR_SIZE;
+		erase_plan.dirty_sectors[sector_no / 8] |= (1 << (sector_no % 8));
+		erase_plan.position = (sector_no + 1) * SPIFLASH_SECTOR_SIZE;
+	}
+	erase_plan.status.checked = erase_plan.position - erase_plan.status.start;
+
+	if (erase_plan.status.checked < erase_plan.status.length) {
+		spiflash_erase_plan_submit(SPIFLASH_TRANSACTION_READ, erase_plan.check_data, sizeof(erase_plan.check_data));
+	} else {
+		spiflash_stream_close();
+		spiflash_erase_plan_report();
+		erase_plan.checking = false;
+		erase_plan.position = erase_plan.status.start;
+		spiflash_erase_plan_next_erase();
+	}
+}
+
+/* Erases a sector aligned range in the background; the callback (if any) is
+ * called from interrupt context after the blank check, after every erase
+ * operation and when done, and should only take note of the change. Returns false if the range is invalid or another
+ * erase is still in progress. */
+bool spiflash_erase_range(uint32_t start, uint32_t length, spiflash_erase_callback_t callback) {
+	if (erase_plan.status.active || (length == 0) || (start % SPIFLASH_SECTOR_SIZE) || (length % SPIFLASH_SECTOR_SIZE) || (start + length > SPIFLASH_SIZE) || (start + length < start)) {
+		return false;
+	}
+	memset(&erase_plan.status, 0, sizeof(erase_plan.status));
+	memset(erase_plan.dirty_sectors, 0, sizeof(erase_plan.dirty_sectors));
+	erase_plan.status.start = start;
+	erase_plan.status.length = length;
+	erase_plan.status.active = true;
+	erase_plan.callback = callback;
+	erase_plan.position = start;
+	erase_plan.checking = true;
+	erase_plan.start_ticks = systick_get_ticks();
+	spiflash_erase_plan_submit(SPIFLASH_TRANSACTION_READ, erase_plan.check_data, sizeof(erase_plan.check_data));
+	return true;
+}
+
+const struct spiflash_erase_status_t *spiflash_erase_status(void) {
+	return &erase_plan.status;
 }
 
 void spiflash_reset(void) {
 	uint8_t data = SPIFLASH_ENABLE_RESET;
-	spiflash_txrx(&data, 1);
+	spiflash_transact(SPIFLASH_TRANSACTION_COMMAND, 0, &data, 1);
 
 	data = SPIFLASH_RESET;
-	spiflash_txrx(&data, 1);
+	spiflash_transact(SPIFLASH_TRANSACTION_COMMAND, 0, &data, 1);
 }
 
-void spiflash_read(uint32_t start_address, void *buffer, unsigned int length) {
-	uint8_t data[4] = { SPIFLASH_READ_DATA, (start_address >> 16) & 0xff, (start_address >> 8) & 0xff, (start_address >> 0) & 0xff };
-	w25qxx_cs_set_active();
-	spiflash_txrx_raw(data, sizeof(data));
-	spiflash_txrx_raw(buffer, length);
-	w25qxx_cs_set_inactive();
+/* Returns false if the transfer failed */
+bool spiflash_read(uint32_t start_address, void *buffer, unsigned int length) {
+	const bool success = spiflash_transact(SPIFLASH_TRANSACTION_READ, start_address, buffer, length) == DMA_SUCCESS;
+	spiflash_stream_close();
+	return success;
 }
 
-void spiflash_write_page(unsigned int page_no, const void *page_content) {
-	{
-		uint8_t data[1] = { SPIFLASH_WRITE_ENABLE };
-		spiflash_txrx(data, sizeof(data));
+/* May be called from the main loop while audio is streaming; waits until the
+ * bus is idle */
+void spiflash_set_read_config(const struct spiflash_read_config_t *config) {
+	while (true) {
+		__disable_irq();
+		if (!queue.active) {
+			spiflash_stream_end();
+			read_config = *config;
+			while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY) == SET);
+			SPI1->CR1 &= ~SPI_CR1_SPE;
+			SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_BR) | config->prescaler;
+			SPI1->CR1 |= SPI_CR1_SPE;
+			__enable_irq();
+			return;
+		}
+		__enable_irq();
 	}
-	{
-		const unsigned int address = page_no * SPIFLASH_PAGE_SIZE;
-		uint8_t data[4 + SPIFLASH_PAGE_SIZE] = { SPIFLASH_PAGE_PROGRAM, (address >> 16) & 0xff, (address >> 8) & 0xff, (address >> 0) & 0xff };
-		memcpy(data + 4, page_content, SPIFLASH_PAGE_SIZE);
-		spiflash_txrx(data, sizeof(data));
-		spiflash_wait_finished();
+}
+
+const struct spiflash_read_config_t *spiflash_get_read_config(void) {
+	return &read_config;
+}
+
+unsigned int spiflash_prescaler_to_khz(uint16_t prescaler) {
+	return 72000 / (2 << (prescaler >> 3));
+}
+
+/* Reads the given range in blocks of 512 bytes with every read configuration
+ * up to 36 MHz and compares the data to a read at 4.5 MHz. Only the reads
+ * including their command are timed. Nothing else should use the flash
+ * meanwhile. */
+void spiflash_benchmark(uint32_t address, unsigned int length) {
+	static const uint16_t prescalers[] = { SPI_BaudRatePrescaler_16, SPI_BaudRatePrescaler_8, SPI_BaudRatePrescaler_4, SPI_BaudRatePrescaler_2 };
+	const struct spiflash_read_config_t previous_config = read_config;
+	const struct spiflash_read_config_t reference_config = {
+		.prescaler = SPI_BaudRatePrescaler_16,
+		.fast_read = false,
+		.wide_frames = false,
+	};
+	uint32_t reference_data[128];
+	uint32_t data[128];
+
+	printf("Reading %u bytes from 0x%lx per setting.\n", length, address);
+	for (unsigned int i = 0; i < sizeof(prescalers) / sizeof(prescalers[0]); i++) {
+		for (unsigned int mode = 0; mode < 4; mode++) {
+			const struct spiflash_read_config_t config = {
+				.prescaler = prescalers[i],
+				.fast_read = mode & 1,
+				.wide_frames = mode & 2,
+			};
+			uint64_t cycles = 0;
+			unsigned int bytes_read = 0;
+			unsigned int errors = 0;
+			for (unsigned int offset = 0; offset < length; offset += sizeof(data)) {
+				spiflash_set_read_config(&reference_config);
+				spiflash_read(address + offset, reference_data, sizeof(reference_data));
+				spiflash_set_read_config(&config);
+				memset(data, 0, sizeof(data));
+
+				const uint32_t start = SysTick->VAL;
+				const bool success = spiflash_read(address + offset, data, sizeof(data));
+				cycles += systick_cycles_since(start);
+				bytes_read += sizeof(data);
+				if (!success) {
+					errors += sizeof(data);
+					continue;
+				}
+				for (unsigned int j = 0; j < sizeof(data); j++) {
+					if (((uint8_t*)data)[j] != ((uint8_t*)reference_data)[j]) {
+						errors++;
+					}
+				}
+			}
+			const unsigned int centi_mb_per_sec = (cycles == 0) ? 0 : ((uint64_t)bytes_read * 7200 / cycles);
+			const unsigned int khz = spiflash_prescaler_to_khz(config.prescaler);
+			printf("%2u.%u MHz %s %2d bit: %u.%02u MB/s, %u of %u bytes wrong\n", khz / 1000, khz % 1000 / 100, config.fast_read ? "FAST_READ" : "READ_DATA", config.wide_frames ? 16 : 8, centi_mb_per_sec / 100, centi_mb_per_sec % 100, errors, bytes_read);
+		}
 	}
+	spiflash_set_read_config(&previous_config);
+}
+
+bool spiflash_write_page(unsigned int page_no, const void *page_content) {
+	return spiflash_transact(SPIFLASH_TRANSACTION_PROGRAM_PAGE, page_no * SPIFLASH_PAGE_SIZE, (void*)page_content, SPIFLASH_PAGE_SIZE) == DMA_SUCCESS;
 }
 
 struct spiflash_manufacturer_t spiflash_identify(void) {
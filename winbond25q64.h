@@ -25,9 +25,11 @@
 #define __WINBOND25Q64_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define	SPIFLASH_SECTOR_SIZE		4096
 #define SPIFLASH_PAGE_SIZE			256
+#define SPIFLASH_SIZE				(8 * 1024 * 1024)
 
 #define SPIFLASH_STATUS_SUS			(7 << 15)
 #define SPIFLASH_STATUS_CMP			(7 << 14)
@@ -88,20 +90,70 @@ enum dma_state_t {
 	DMA_ERROR = 3,
 };
 
+enum spiflash_transaction_type_t {
+	SPIFLASH_TRANSACTION_READ,
+	SPIFLASH_TRANSACTION_COMMAND,			/* Full duplex exchange, data starts with the instruction */
+	SPIFLASH_TRANSACTION_PROGRAM_PAGE,
+	SPIFLASH_TRANSACTION_ERASE,				/* Length is the sector, block or chip size */
+};
+
+enum spiflash_priority_t {
+	SPIFLASH_PRIORITY_AUDIO = 0,
+	SPIFLASH_PRIORITY_MAINTENANCE = 1,
+};
+#define SPIFLASH_PRIORITY_COUNT		2
+
+struct spiflash_transaction_t;
+typedef void (*spiflash_callback_t)(struct spiflash_transaction_t *transaction);
+
+struct spiflash_transaction_t {
+	enum spiflash_transaction_type_t type;
+	uint32_t address;
+	void *data;
+	unsigned int length;
+	spiflash_callback_t callback;			/* Optional, mostly called from interrupt context */
+	volatile enum dma_state_t state;		/* DMA_IN_PROGRESS until completed */
+	struct spiflash_transaction_t *next;
+};
+
+struct spiflash_erase_status_t {
+	uint32_t start;
+	uint32_t length;
+	uint32_t checked;			/* Bytes blank checked */
+	uint32_t done;				/* Bytes erased or skipped as blank */
+	uint32_t erased;
+	uint32_t erase_operations;
+	uint32_t milliseconds;
+	bool active;
+	bool failed;
+};
+typedef void (*spiflash_erase_callback_t)(const struct spiflash_erase_status_t *status);
+
+struct spiflash_read_config_t {
+	uint16_t prescaler;			/* SPI_BaudRatePrescaler_* */
+	bool fast_read;
+	bool wide_frames;
+};
+
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-enum dma_state_t spiflash_get_dma_state(void);
+void spiflash_stream_close(void);
 void SPI1_Handler(void);
 void DMA1_Channel2_Handler(void);
 void DMA1_Channel3_Handler(void);
-void spiflash_txrx_dma(void *vdata, unsigned int length);
+void TIM3_Handler(void);
+void spiflash_submit(struct spiflash_transaction_t *transaction, enum spiflash_priority_t priority);
 struct spiflash_manufacturer_t spiflash_read_id(void);
-struct spiflash_manufacturer_t spiflash_read_id_dma(void);
 uint16_t spiflash_read_status(void);
-void spiflash_wait_finished(void);
-void spiflash_erase_sector(unsigned int sector_no);
+bool spiflash_erase_sector(unsigned int sector_no);
+bool spiflash_erase_range(uint32_t start, uint32_t length, spiflash_erase_callback_t callback);
+const struct spiflash_erase_status_t *spiflash_erase_status(void);
 void spiflash_reset(void);
-void spiflash_read(uint32_t start_address, void *buffer, unsigned int length);
-void spiflash_write_page(unsigned int page_no, const void *page_content);
+bool spiflash_read(uint32_t start_address, void *buffer, unsigned int length);
+void spiflash_set_read_config(const struct spiflash_read_config_t *config);
+const struct spiflash_read_config_t *spiflash_get_read_config(void);
+unsigned int spiflash_prescaler_to_khz(uint16_t prescaler);
+void spiflash_benchmark(uint32_t address, unsigned int length);
+bool spiflash_write_page(unsigned int page_no, const void *page_content);
 struct spiflash_manufacturer_t spiflash_identify(void);
 void spiflash_selfcheck(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/